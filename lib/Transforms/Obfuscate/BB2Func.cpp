@@ -2,6 +2,7 @@
 #include "llvm/Pass.h"
 #include "llvm/Transforms/Utils/CodeExtractor.h"
 
+#include "Passes.h"
 #include "Util.h"
 
 #include <algorithm>
@@ -27,6 +28,12 @@ static RegisterPass<BB2Func> X("bb2func",
                                "Split & extract basic blocks to functions");
 Pass *createBB2FuncPass() { return new BB2Func(); }
 
+PreservedAnalyses BB2FuncPass::run(Function &F, FunctionAnalysisManager &AM) {
+  if (!BB2Func().runOnFunction(F))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
 bool BB2Func::runOnFunction(Function &F) {
   bool modified = false;
   if (F.getEntryBlock().getName() == "newFuncRoot")
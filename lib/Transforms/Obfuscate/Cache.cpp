@@ -0,0 +1,499 @@
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include "Cache.h"
+#include "Util.h"
+
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string>
+    CacheDir("obf-cache-dir", cl::init(""),
+             cl::desc("Reuse obfuscated functions and modules from this "
+                      "directory (needs -obf-seed)"));
+
+// Bump when a pass changes its output for the same input and options
+static const char CacheVersion[] = "4";
+
+namespace {
+// Named types of a cached module parsed into the context of M were renamed
+// on conflict (%struct.foo to %struct.foo.1); map them back to those of M.
+class CachedTypeRemapper : public ValueMapTypeRemapper {
+public:
+  CachedTypeRemapper(Module &M) : M(M) {}
+  Type *remapType(Type *SrcTy) override;
+
+private:
+  Module &M;
+  std::map<Type *, Type *> Mapped;
+};
+} // namespace
+
+Type *CachedTypeRemapper::remapType(Type *SrcTy) {
+  auto It = Mapped.find(SrcTy);
+  if (It != Mapped.end())
+    return It->second;
+  Type *Ty = SrcTy;
+  if (StructType *ST = dyn_cast<StructType>(SrcTy)) {
+    if (ST->hasName()) {
+      std::pair<StringRef, StringRef> Parts = ST->getName().rsplit('.');
+      StructType *DT = nullptr;
+      if (!Parts.second.empty() &&
+          Parts.second.find_first_not_of("0123456789") == StringRef::npos)
+        DT = M.getTypeByName(Parts.first);
+      if (!DT || DT->getNumElements() != ST->getNumElements() ||
+          DT->isPacked() != ST->isPacked())
+        return Mapped[SrcTy] = SrcTy;
+      // Breaks cycles through pointers
+      Mapped[SrcTy] = DT;
+      for (unsigned i = 0; i < ST->getNumElements(); i++)
+        if (remapType(ST->getElementType(i)) != DT->getElementType(i))
+          return Mapped[SrcTy] = SrcTy;
+      return DT;
+    }
+    std::vector<Type *> Elems;
+    for (Type *E : ST->elements())
+      Elems.push_back(remapType(E));
+    Ty = StructType::get(M.getContext(), Elems, ST->isPacked());
+  } else if (PointerType *PT = dyn_cast<PointerType>(SrcTy)) {
+    Ty = PointerType::get(remapType(PT->getElementType()),
+                          PT->getAddressSpace());
+  } else if (ArrayType *AT = dyn_cast<ArrayType>(SrcTy)) {
+    Ty = ArrayType::get(remapType(AT->getElementType()), AT->getNumElements());
+  } else if (VectorType *VT = dyn_cast<VectorType>(SrcTy)) {
+    Ty = VectorType::get(remapType(VT->getElementType()), VT->getNumElements());
+  } else if (FunctionType *FT = dyn_cast<FunctionType>(SrcTy)) {
+    std::vector<Type *> Params;
+    for (Type *P : FT->params())
+      Params.push_back(remapType(P));
+    Ty = FunctionType::get(remapType(FT->getReturnType()), Params,
+                           FT->isVarArg());
+  }
+  return Mapped[SrcTy] = Ty;
+}
+
+static void collectGlobals(Value *V, std::vector<GlobalValue *> &Globals,
+                           SmallPtrSetImpl<Value *> &Visited) {
+  if (!isa<Constant>(V) || !Visited.insert(V).second)
+    return;
+  if (GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
+    Globals.push_back(GV);
+    return;
+  }
+  for (Value *Op : cast<Constant>(V)->operands())
+    collectGlobals(Op, Globals, Visited);
+}
+
+// A cache that cannot be written only costs time, but should not go unnoticed
+static void reportError(const Twine &What, std::error_code EC) {
+  errs() << "warning: obf-cache-dir: " << What << ": " << EC.message()
+         << '\n';
+}
+
+static bool writeFileAtomically(StringRef Data, StringRef Path) {
+  int FD;
+  SmallString<128> TmpPath;
+  if (std::error_code EC =
+          sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TmpPath)) {
+    reportError("cannot create " + Path, EC);
+    return false;
+  }
+  std::error_code EC;
+  {
+    raw_fd_ostream OS(FD, true);
+    OS << Data;
+    OS.close();
+    EC = OS.error();
+    OS.clear_error();
+  }
+  if (!EC)
+    EC = sys::fs::rename(TmpPath, Path);
+  if (EC) {
+    reportError("cannot write " + Path, EC);
+    sys::fs::remove(TmpPath);
+    return false;
+  }
+  return true;
+}
+
+static bool writeModuleAtomically(const Module &M, StringRef Path) {
+  SmallString<0> Code;
+  raw_svector_ostream OS(Code);
+  WriteBitcodeToFile(M, OS);
+  return writeFileAtomically(Code, Path);
+}
+
+bool ObfCache::enabled() { return !CacheDir.empty() && obfSeed(); }
+
+ObfCache::ObfCache(StringRef Pass, Function &F, StringRef Options)
+    : F(&F), M(*F.getParent()) {
+  if (!enabled() || F.isDeclaration())
+    return;
+  RNGKey = rngKey(F);
+  Draws = rngDraws(RNGKey);
+  std::string IR;
+  raw_string_ostream OS(IR);
+  OS << F.getAttributes().getAsString(AttributeList::FunctionIndex) << '\n';
+  F.print(OS);
+  computeKey(Pass, OS.str(), Options);
+}
+
+ObfCache::ObfCache(StringRef Pass, Module &M, StringRef Options) : M(M) {
+  if (!enabled())
+    return;
+  RNGKey = rngKey(M);
+  Draws = rngDraws(RNGKey);
+  std::string IR;
+  raw_string_ostream OS(IR);
+  M.print(OS, nullptr);
+  computeKey(Pass, OS.str(), Options);
+}
+
+void ObfCache::computeKey(StringRef Pass, StringRef IR, StringRef Options) {
+  MD5 Hash;
+  Hash.update(CacheVersion);
+  Hash.update(LLVM_VERSION_STRING);
+  Hash.update(utostr(obfSeed()));
+  Hash.update(Pass);
+  Hash.update(makeArrayRef<uint8_t>(0));
+  Hash.update(Options);
+  Hash.update(makeArrayRef<uint8_t>(0));
+  for (auto &D : Draws) {
+    Hash.update(D.first);
+    Hash.update(makeArrayRef<uint8_t>(0));
+    Hash.update(utostr(D.second));
+    Hash.update(makeArrayRef<uint8_t>(0));
+  }
+  Hash.update(M.getTargetTriple());
+  Hash.update(M.getDataLayoutStr());
+  Hash.update(IR);
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  SmallString<32> Hex;
+  MD5::stringifyResult(Result, Hex);
+  if (std::error_code EC = sys::fs::create_directories(CacheDir)) {
+    // Once, rather than for every function
+    static bool Reported = false;
+    if (!Reported)
+      reportError("cannot create " + CacheDir, EC);
+    Reported = true;
+    return;
+  }
+  Entry = CacheDir;
+  sys::path::append(Entry, Hex);
+}
+
+bool ObfCache::replay(StringRef FilePrefix) {
+  if (Entry.empty() || !sys::fs::exists(Entry + ".bc") ||
+      !sys::fs::exists(Entry + ".rng"))
+    return false;
+  // An entry missing any of its files is a miss, checked before M changes
+  SmallVector<StringRef, 4> Names;
+  std::unique_ptr<MemoryBuffer> List;
+  if (!FilePrefix.empty()) {
+    auto BufferOrErr = MemoryBuffer::getFile(Entry + ".list");
+    if (!BufferOrErr)
+      return false;
+    List = std::move(*BufferOrErr);
+    List->getBuffer().split(Names, '\n', -1, false);
+    for (StringRef Name : Names)
+      if (!sys::fs::exists(Entry + ".files/" + Name))
+        return false;
+  }
+  if (!(F ? replayFunction() : replayModule()) || !replayDraws())
+    return false;
+  for (StringRef Name : Names)
+    if (std::error_code EC = sys::fs::copy_file(Entry + ".files/" + Name,
+                                                FilePrefix + Name))
+      reportError("cannot copy " + Name + " to " + FilePrefix + Name, EC);
+  return true;
+}
+
+bool ObfCache::replayFunction() {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> Cached =
+      parseIRFile((Entry + ".bc").str(), Err, M.getContext());
+  return Cached && replaceFunction(*F, *Cached);
+}
+
+bool ObfCache::replayModule() {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> Cached =
+      parseIRFile((Entry + ".bc").str(), Err, M.getContext());
+  if (!Cached)
+    return false;
+
+  std::vector<GlobalValue *> Globals;
+  for (GlobalValue &GV : M.global_values()) {
+    GV.dropAllReferences();
+    Globals.push_back(&GV);
+  }
+  for (GlobalValue *GV : Globals) {
+    GV->replaceAllUsesWith(UndefValue::get(GV->getType()));
+    GV->eraseFromParent();
+  }
+  M.getComdatSymbolTable().clear();
+  while (!M.named_metadata_empty())
+    M.eraseNamedMetadata(&*M.named_metadata_begin());
+  M.setModuleInlineAsm("");
+  // The linker adds globals as it meets them, later passes go in order
+  std::vector<std::string> Order;
+  for (GlobalValue &GV : Cached->global_values())
+    Order.push_back(GV.getName().str());
+  if (Linker::linkModules(M, std::move(Cached)))
+    return false;
+  for (const std::string &Name : Order) {
+    GlobalValue *GV = M.getNamedValue(Name);
+    if (Function *Fn = dyn_cast_or_null<Function>(GV))
+      M.getFunctionList().splice(M.end(), M.getFunctionList(), Fn);
+    else if (GlobalVariable *Var = dyn_cast_or_null<GlobalVariable>(GV))
+      M.getGlobalList().splice(M.global_end(), M.getGlobalList(), Var);
+  }
+  return true;
+}
+
+// Draw the streams the pass drew when the entry was stored
+bool ObfCache::replayDraws() {
+  auto BufferOrErr = MemoryBuffer::getFile(Entry + ".rng");
+  if (!BufferOrErr)
+    return false;
+  SmallVector<StringRef, 4> Lines;
+  (*BufferOrErr)->getBuffer().split(Lines, '\n', -1, false);
+  for (StringRef Line : Lines) {
+    StringRef Pass, Count;
+    std::tie(Pass, Count) = Line.rsplit(' ');
+    unsigned N;
+    if (!Count.getAsInteger(10, N))
+      skipRNG(Pass, RNGKey, N);
+  }
+  return true;
+}
+
+// Written before the module along with the list of files, so that a complete
+// entry always has them
+void ObfCache::store() {
+  if (Entry.empty())
+    return;
+  std::string DrawnNow;
+  for (auto &D : rngDraws(RNGKey))
+    if (D.second > Draws[D.first])
+      DrawnNow += D.first + " " + utostr(D.second - Draws[D.first]) + "\n";
+  if (!writeFileAtomically(DrawnNow, (Entry + ".rng").str()))
+    return;
+  if (!Files.empty() && !writeFileAtomically(Files, (Entry + ".list").str()))
+    return;
+  if (F)
+    writeModuleAtomically(*extractFunction(*F), (Entry + ".bc").str());
+  else
+    writeModuleAtomically(M, (Entry + ".bc").str());
+}
+
+// Call before store, so that a complete entry always has its files. If one
+// cannot be stored, neither is the entry.
+void ObfCache::storeFile(StringRef Name, StringRef Path) {
+  if (Entry.empty())
+    return;
+  SmallString<128> Dest(Entry);
+  Dest += ".files";
+  std::error_code EC = sys::fs::create_directories(Dest);
+  sys::path::append(Dest, Name);
+  if (!EC)
+    EC = sys::fs::copy_file(Path, Dest);
+  if (EC) {
+    reportError("cannot store " + Path + " in " + Dest, EC);
+    Entry.clear();
+    return;
+  }
+  Files += Name.str() + "\n";
+}
+
+static bool isLocalConstant(GlobalValue *GV) {
+  GlobalVariable *Var = dyn_cast<GlobalVariable>(GV);
+  return Var && Var->hasLocalLinkage() && Var->isConstant() &&
+         Var->hasInitializer() && isa<ConstantData>(Var->getInitializer());
+}
+
+// Globals used by F, in order of first use
+static std::vector<GlobalValue *> usedGlobals(Function &F) {
+  std::vector<GlobalValue *> Globals;
+  SmallPtrSet<Value *, 32> Visited;
+  for (Instruction &I : instructions(F))
+    for (Value *Op : I.operands())
+      collectGlobals(Op, Globals, Visited);
+  if (F.hasPersonalityFn())
+    collectGlobals(F.getPersonalityFn(), Globals, Visited);
+  return Globals;
+}
+
+bool isExtractable(Function &F) {
+  return F.hasName() && all_of(usedGlobals(F), [](GlobalValue *GV) {
+           return GV->hasName();
+         });
+}
+
+std::unique_ptr<Module> extractFunction(Function &F) {
+  Module &M = *F.getParent();
+  std::vector<GlobalValue *> Globals = usedGlobals(F);
+
+  std::unique_ptr<Module> Part(
+      new Module(M.getModuleIdentifier(), M.getContext()));
+  Part->setSourceFileName(M.getSourceFileName());
+  Part->setTargetTriple(M.getTargetTriple());
+  Part->setDataLayout(M.getDataLayout());
+  ValueToValueMapTy VMap;
+  for (GlobalValue *GV : Globals) {
+    if (GV == &F)
+      continue;
+    GlobalValue *Decl;
+    if (Function *Callee = dyn_cast<Function>(GV)) {
+      Function *NF = Function::Create(Callee->getFunctionType(),
+                                      GlobalValue::ExternalLinkage,
+                                      Callee->getName(), Part.get());
+      NF->setAttributes(Callee->getAttributes());
+      Decl = NF;
+    } else if (GV->getValueType()->isFunctionTy()) {
+      Decl = Function::Create(cast<FunctionType>(GV->getValueType()),
+                              GlobalValue::ExternalLinkage, GV->getName(),
+                              Part.get());
+    } else if (isLocalConstant(GV)) {
+      // Tables the passes add are copied, replaceFunction recreates them
+      GlobalVariable *Var = cast<GlobalVariable>(GV);
+      GlobalVariable *NV = new GlobalVariable(
+          *Part, Var->getValueType(), true, Var->getLinkage(),
+          Var->getInitializer(), Var->getName());
+      NV->copyAttributesFrom(Var);
+      Decl = NV;
+    } else {
+      Decl = new GlobalVariable(
+          *Part, GV->getValueType(), false, GlobalValue::ExternalLinkage,
+          nullptr, GV->getName(), nullptr, GV->getThreadLocalMode(),
+          GV->getType()->getAddressSpace());
+    }
+    VMap[GV] = Decl;
+  }
+  Function *NF = Function::Create(F.getFunctionType(), F.getLinkage(),
+                                  F.getName(), Part.get());
+  VMap[&F] = NF;
+  Function::arg_iterator DestArg = NF->arg_begin();
+  for (Argument &Arg : F.args()) {
+    DestArg->setName(Arg.getName());
+    VMap[&Arg] = &*DestArg++;
+  }
+  SmallVector<ReturnInst *, 8> Returns;
+  CloneFunctionInto(NF, &F, VMap, true, Returns);
+  return Part;
+}
+
+static void cloneBody(Function *Dst, Function *Src, ValueToValueMapTy &VMap,
+                      ValueMapTypeRemapper &Remapper) {
+  Function::arg_iterator DestArg = Dst->arg_begin();
+  for (Argument &Arg : Src->args()) {
+    DestArg->setName(Arg.getName());
+    VMap[&Arg] = &*DestArg++;
+  }
+  SmallVector<ReturnInst *, 8> Returns;
+  CloneFunctionInto(Dst, Src, VMap, true, Returns, "", nullptr, &Remapper);
+}
+
+// Declarations in Part are mapped by name to the globals of M, functions it
+// defines besides F are added to M, and so are its local constants unless M
+// has an identical one. Nothing is changed if that fails.
+bool replaceFunction(Function &F, Module &Part) {
+  Module &M = *F.getParent();
+  if (!F.hasName())
+    return false;
+  Function *PF = Part.getFunction(F.getName());
+  if (!PF || PF->isDeclaration())
+    return false;
+  CachedTypeRemapper Remapper(M);
+  if (Remapper.remapType(PF->getFunctionType()) != F.getFunctionType())
+    return false;
+  ValueToValueMapTy VMap;
+  VMap[PF] = &F;
+  std::vector<Function *> NewFunctions, NewDeclarations;
+  std::vector<GlobalVariable *> NewConstants;
+  for (GlobalValue &GV : Part.global_values()) {
+    if (&GV == PF)
+      continue;
+    Function *Fn = dyn_cast<Function>(&GV);
+    if (Fn && !Fn->isDeclaration()) {
+      NewFunctions.push_back(Fn);
+      continue;
+    }
+    if (isLocalConstant(&GV)) {
+      GlobalVariable *Var = cast<GlobalVariable>(&GV);
+      if (Remapper.remapType(Var->getValueType()) != Var->getValueType())
+        return false;
+      GlobalVariable *DVar = M.getGlobalVariable(Var->getName(), true);
+      if (DVar && isLocalConstant(DVar) &&
+          DVar->getInitializer() == Var->getInitializer() &&
+          DVar->getAlignment() == Var->getAlignment())
+        VMap[Var] = DVar;
+      else
+        NewConstants.push_back(Var);
+      continue;
+    }
+    if (!GV.isDeclaration() || !GV.hasName())
+      return false;
+    GlobalValue *DGV = M.getNamedValue(GV.getName());
+    if (!DGV) {
+      if (!Fn)
+        return false;
+      NewDeclarations.push_back(Fn);
+      continue;
+    }
+    if (Remapper.remapType(GV.getType()) != DGV->getType())
+      return false;
+    VMap[&GV] = DGV;
+  }
+
+  for (GlobalVariable *Var : NewConstants) {
+    GlobalVariable *NV = new GlobalVariable(
+        M, Var->getValueType(), true, Var->getLinkage(),
+        Var->getInitializer(), Var->getName());
+    NV->copyAttributesFrom(Var);
+    VMap[Var] = NV;
+  }
+  for (Function *Fn : NewDeclarations) {
+    Function *NF = Function::Create(
+        cast<FunctionType>(Remapper.remapType(Fn->getFunctionType())),
+        Fn->getLinkage(), Fn->getName(), &M);
+    NF->setAttributes(Fn->getAttributes());
+    VMap[Fn] = NF;
+  }
+  for (Function *Fn : NewFunctions) {
+    Function *NF = Function::Create(
+        cast<FunctionType>(Remapper.remapType(Fn->getFunctionType())),
+        Fn->getLinkage(), Fn->getName(), &M);
+    NF->copyAttributesFrom(Fn);
+    VMap[Fn] = NF;
+  }
+  GlobalValue::LinkageTypes Linkage = F.getLinkage();
+  F.deleteBody();
+  F.setLinkage(Linkage);
+  cloneBody(&F, PF, VMap, Remapper);
+  for (Function *Fn : NewFunctions)
+    cloneBody(cast<Function>(VMap[Fn]), Fn, VMap, Remapper);
+  return true;
+}
@@ -0,0 +1,62 @@
+#ifndef LLVM_TRANSFORMS_OBFUSCATE_CACHE_H
+#define LLVM_TRANSFORMS_OBFUSCATE_CACHE_H
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+
+#include <map>
+#include <memory>
+#include <string>
+
+// Content-addressed cache of obfuscated IR under -obf-cache-dir. An entry is
+// keyed by the IR before the pass, the pass name, its options, -obf-seed and
+// the random streams already drawn for the function or module. Function
+// passes store the obfuscated function alone, module passes the whole module
+// plus any files they wrote, and both the streams they drew. Nothing is
+// cached without an explicit seed, since the output would differ on every
+// run anyway.
+class ObfCache {
+public:
+  ObfCache(llvm::StringRef Pass, llvm::Function &F, llvm::StringRef Options);
+  ObfCache(llvm::StringRef Pass, llvm::Module &M, llvm::StringRef Options);
+
+  // Replace the function body or the module by the cached result. Files
+  // stored with storeFile are copied back to FilePrefix + Name; an entry
+  // missing any of them is a miss. Failures to store are reported on errs().
+  bool replay(llvm::StringRef FilePrefix = "");
+  void store();
+  void storeFile(llvm::StringRef Name, llvm::StringRef Path);
+  // Whether -obf-cache-dir and -obf-seed are both given
+  static bool enabled();
+
+private:
+  llvm::Function *F = nullptr;
+  llvm::Module &M;
+  // createRNG key of F or M, and its streams drawn before the pass
+  std::string RNGKey;
+  std::map<std::string, unsigned> Draws;
+  // Names given to storeFile, one per line
+  std::string Files;
+  // Empty if caching is off
+  llvm::SmallString<128> Entry;
+
+  void computeKey(llvm::StringRef Pass, llvm::StringRef IR,
+                  llvm::StringRef Options);
+  bool replayFunction();
+  bool replayModule();
+  bool replayDraws();
+};
+
+// Copy of F in a module of its own, with declarations of the globals it uses
+// and copies of the local constants
+std::unique_ptr<llvm::Module> extractFunction(llvm::Function &F);
+// Whether replaceFunction can map F and the globals it uses back by name
+bool isExtractable(llvm::Function &F);
+// Replace the body of F by that of its namesake in Part, a module parsed into
+// the context of F, and add the other functions and local constants Part
+// defines to the module of F. Fails if Part defines other variables or refers
+// to missing or unnamed ones.
+bool replaceFunction(llvm::Function &F, llvm::Module &Part);
+
+#endif
@@ -1,9 +1,13 @@
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Pass.h"
 
+#include "Cache.h"
+#include "Passes.h"
+#include "Profile.h"
 #include "Util.h"
 
 #include <algorithm>
@@ -20,7 +24,14 @@ struct Connect : public FunctionPass {
 
   Connect() : FunctionPass(ID) {}
 
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    if (profileEnabled())
+      AU.addRequired<BlockFrequencyInfoWrapperPass>();
+  }
+
   bool runOnFunction(Function &F) override;
+  bool run(Function &F, BlockFrequencyInfo *BFI);
+  bool connect(Function &F, BlockFrequencyInfo *BFI);
 };
 } // namespace
 
@@ -29,11 +40,37 @@ static RegisterPass<Connect>
     X("connect", "Split & connect basic blocks & add garbage blocks");
 Pass *createConnectPass() { return new Connect(); }
 
+PreservedAnalyses ConnectPass::run(Function &F, FunctionAnalysisManager &AM) {
+  BlockFrequencyInfo *BFI = nullptr;
+  if (profileEnabled())
+    BFI = &AM.getResult<BlockFrequencyAnalysis>(F);
+  if (!Connect().run(F, BFI))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
 bool Connect::runOnFunction(Function &F) {
+  BlockFrequencyInfo *BFI = nullptr;
+  if (profileEnabled())
+    BFI = &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+  return run(F, BFI);
+}
+
+bool Connect::run(Function &F, BlockFrequencyInfo *BFI) {
+  ObfCache Cache("connect", F, profileOptions(F));
+  if (Cache.replay())
+    return true;
+  bool modified = connect(F, BFI);
+  Cache.store();
+  return modified;
+}
+
+bool Connect::connect(Function &F, BlockFrequencyInfo *BFI) {
   Function *f = &F;
   std::vector<BasicBlock *> origBB, downBB, allBB;
-  std::random_device rd;
-  std::mt19937 g(rd());
+  ObfRNG g = createRNG("connect", F);
+  // Blocks too hot for the overhead budget are neither split nor connected
+  SmallPtrSet<BasicBlock *, 16> hotBB = hotBlocks(F, BFI);
 
   Function::iterator i = f->begin();
   for (++i; i != f->end(); ++i) {
@@ -46,7 +83,7 @@ bool Connect::runOnFunction(Function &F) {
     BasicBlock *i = *b;
     BasicBlock::iterator it = i->getFirstInsertionPt();
     size_t bbSize = std::distance(it, i->end());
-    if (bbSize < 4) {
+    if (bbSize < 4 || hotBB.count(i)) {
       b = origBB.erase(b);
       continue;
     }
@@ -78,7 +115,7 @@ bool Connect::runOnFunction(Function &F) {
     i->getTerminator()->eraseFromParent();
     BasicBlock *defaultBB =
         BasicBlock::Create(f->getContext(), "", f, shuffleBB[num]);
-    CallInst::Create(generateGarbage(f), "", defaultBB);
+    CallInst::Create(generateGarbage(f, g), "", defaultBB);
     new UnreachableInst(f->getContext(), defaultBB);
 
     std::uniform_int_distribution<uint32_t> rand(0, UINT32_MAX);
@@ -11,14 +11,32 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 
+#include "Cache.h"
+#include "Passes.h"
+#include "Profile.h"
 #include "Util.h"
 
 #include <algorithm>
@@ -27,7 +45,96 @@
 
 using namespace llvm;
 
+#define DEBUG_TYPE "flattening"
+
+enum DispatchMode { DMHash, DMDense };
+enum DenseHash { DHXor, DHMul, DHMix };
+
+static cl::opt<DispatchMode> Dispatch(
+    "flattening-dispatch", cl::init(DMHash),
+    cl::desc("How the dispatcher maps states to blocks"),
+    cl::values(clEnumValN(DMHash, "hash",
+                          "Switch on iterated FNV hashes of the state"),
+               clEnumValN(DMDense, "dense",
+                          "Switch on a perfect hash of the state onto the "
+                          "case numbers, lowered to one jump table")));
+
+static cl::opt<DenseHash> DenseHashFn(
+    "flattening-dense-hash", cl::init(DHMul),
+    cl::desc("Perfect hash of -flattening-dispatch=dense"),
+    cl::values(clEnumValN(DHXor, "xor", "One xor, 1 cycle"),
+               clEnumValN(DHMul, "mul", "Xor and multiply, 4 cycles"),
+               clEnumValN(DHMix, "mix",
+                          "Xor, multiply and two xorshifts, 8 cycles")));
+
+enum FlattenScope { FSFunction, FSLoops };
+
+static cl::opt<FlattenScope> Scope(
+    "flattening-scope", cl::init(FSFunction),
+    cl::desc("What shares a dispatcher"),
+    cl::values(clEnumValN(FSFunction, "function", "The whole function"),
+               clEnumValN(FSLoops, "loops",
+                          "Each loop, with the blocks of inner loops "
+                          "left to their own dispatcher")));
+
+static cl::opt<unsigned> DispatchCopies(
+    "flattening-dispatch-copies", cl::init(0),
+    cl::desc("Instructions to spend on copies of the dispatcher at the end "
+             "of flattened blocks"));
+
+static cl::opt<bool> KeepSSA(
+    "flattening-ssa", cl::init(false),
+    cl::desc("Rebuild SSA through the dispatcher after flattening instead of "
+             "leaving values demoted to the stack"));
+
+enum SwitchMode { SMLower, SMTable };
+
+static cl::opt<SwitchMode> Switches(
+    "flattening-switch", cl::init(SMLower),
+    cl::desc("How switches are flattened"),
+    cl::values(clEnumValN(SMLower, "lower",
+                          "Lower them to branches first"),
+               clEnumValN(SMTable, "table",
+                          "Keep them, with the next state of dense ones "
+                          "read from a table indexed by the condition")));
+
+enum TransitionMode { TMInline, TMTable };
+
+static cl::opt<TransitionMode> Transitions(
+    "flattening-transitions", cl::init(TMInline),
+    cl::desc("How flattened blocks compute their next state"),
+    cl::values(clEnumValN(TMInline, "inline",
+                          "Xor chains of constants masked by the condition"),
+               clEnumValN(TMTable, "table",
+                          "One load from a read-only table of the function, "
+                          "at an index derived from the state and the "
+                          "condition")));
+
+enum BlockLayout { BLRandom, BLHot };
+
+static cl::opt<BlockLayout> Layout(
+    "flattening-layout", cl::init(BLRandom),
+    cl::desc("Order of the flattened blocks in the function"),
+    cl::values(clEnumValN(BLRandom, "random", "Random"),
+               clEnumValN(BLHot, "hot",
+                          "Blocks making up most of the estimated or "
+                          "profiled frequency in chains next to the "
+                          "dispatcher, the others in random order")));
+
+static cl::opt<unsigned> ChunkBlocks(
+    "flattening-chunk-blocks", cl::init(0),
+    cl::desc("Blocks per dispatcher beyond which a function (or loop) is "
+             "split into chunks, each with a dispatcher of its own (0 for "
+             "no limit)"));
+
+static cl::opt<unsigned> ChunkInsts(
+    "flattening-chunk-insts", cl::init(0),
+    cl::desc("Instructions per dispatcher beyond which a function (or "
+             "loop) is split into chunks (0 for no limit)"));
+
 // Stats
+STATISTIC(NumChunked, "Regions split into chunks");
+STATISTIC(NumChunks, "Chunks with a dispatcher of their own");
 
 namespace {
 struct Flattening : public FunctionPass {
@@ -38,36 +145,160 @@ struct Flattening : public FunctionPass {
   }
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
-    AU.addRequiredID(LowerSwitchID);
+    if (Switches == SMLower)
+      AU.addRequiredID(LowerSwitchID);
+    if (needsFrequency())
+      AU.addRequired<BlockFrequencyInfoWrapperPass>();
   }
 
   bool runOnFunction(Function &F) override;
-  bool flatten(Function *f);
+  bool run(Function &F, BlockFrequencyInfo *BFI);
+  static bool needsFrequency() { return Layout == BLHot || profileEnabled(); }
+  bool flatten(Function *f, BlockFrequencyInfo *BFI);
+  void flattenRegion(Function *f, BasicBlock *insert,
+                     std::vector<BasicBlock *> origBB, ObfRNG &g, ObfRNG &kg,
+                     size_t &copyBudget, std::vector<AllocaInst *> &stateVars);
+  std::vector<BasicBlock *>
+  flattenLevel(Function *f, BasicBlock *insert,
+               std::vector<BasicBlock *> origBB, ObfRNG &g, ObfRNG &kg,
+               size_t &copyBudget, std::vector<AllocaInst *> &stateVars);
+  std::vector<size_t> hotLayout(const std::vector<BasicBlock *> &origBB,
+                                const std::vector<size_t> &bbSeq);
+
+private:
+  // Frequency of the blocks before flattening, for -flattening-layout=hot
+  DenseMap<BasicBlock *, uint64_t> blockFreq;
+  // Changes of state of -flattening-transitions=table, and the variable
+  // standing for their table until the function is flattened
+  std::vector<uint32_t> transTable;
+  GlobalVariable *transVar = nullptr;
+};
+
+// Random bijection of i32 used as the perfect hash of dense dispatch. States
+// are picked as the preimages of the case numbers 0..n-1, so the hash maps
+// them onto a dense range without a search.
+struct DenseKey {
+  uint32_t Xor;
+  uint32_t Mul, MulInv;
+  unsigned Shift1, Shift2;
+
+  DenseKey(ObfRNG &g);
+  uint32_t unhash(uint32_t Case) const;
+  Value *hash(Value *State, BasicBlock *BB) const;
 };
 } // namespace
 
+DenseKey::DenseKey(ObfRNG &g) {
+  std::uniform_int_distribution<uint32_t> rand(0, UINT32_MAX);
+  Xor = rand(g);
+  Mul = rand(g) | 1;
+  MulInv = modinv(Mul, 32);
+  Shift1 = 7 + rand(g) % 10;
+  Shift2 = 7 + rand(g) % 10;
+}
+
+// Inverse of x ^ (x >> Shift)
+static uint32_t unxorshift(uint32_t x, unsigned Shift) {
+  uint32_t r = x;
+  for (unsigned k = Shift; k < 32; k += Shift)
+    r ^= x >> k;
+  return r;
+}
+
+uint32_t DenseKey::unhash(uint32_t Case) const {
+  uint32_t x = Case;
+  switch (DenseHashFn) {
+  case DHXor:
+    break;
+  case DHMul:
+    x *= MulInv;
+    break;
+  case DHMix:
+    x = unxorshift(unxorshift(x, Shift2) * MulInv, Shift1);
+    break;
+  }
+  return x ^ Xor;
+}
+
+Value *DenseKey::hash(Value *State, BasicBlock *BB) const {
+  Type *i32 = State->getType();
+  Value *x = BinaryOperator::Create(BinaryOperator::Xor, State,
+                                    ConstantInt::get(i32, Xor), "", BB);
+  if (DenseHashFn == DHMix)
+    x = BinaryOperator::Create(
+        BinaryOperator::Xor, x,
+        BinaryOperator::Create(BinaryOperator::LShr, x,
+                               ConstantInt::get(i32, Shift1), "", BB),
+        "", BB);
+  if (DenseHashFn != DHXor)
+    x = BinaryOperator::Create(BinaryOperator::Mul, x,
+                               ConstantInt::get(i32, Mul), "", BB);
+  if (DenseHashFn == DHMix)
+    x = BinaryOperator::Create(
+        BinaryOperator::Xor, x,
+        BinaryOperator::Create(BinaryOperator::LShr, x,
+                               ConstantInt::get(i32, Shift2), "", BB),
+        "", BB);
+  return x;
+}
+
 char Flattening::ID = 0;
 static RegisterPass<Flattening> X("flattening", "Call graph flattening");
 Pass *createFlatteningPass() { return new Flattening(); }
 
+PreservedAnalyses FlatteningPass::run(Function &F,
+                                      FunctionAnalysisManager &AM) {
+  // LowerSwitch only exists for the legacy pass manager
+  bool modified = false;
+  if (Switches == SMLower) {
+    legacy::FunctionPassManager FPM(F.getParent());
+    FPM.add(createLowerSwitchPass());
+    FPM.doInitialization();
+    modified = FPM.run(F);
+    FPM.doFinalization();
+    if (modified)
+      AM.invalidate(F, PreservedAnalyses::none());
+  }
+  BlockFrequencyInfo *BFI = nullptr;
+  if (Flattening::needsFrequency())
+    BFI = &AM.getResult<BlockFrequencyAnalysis>(F);
+  modified |= Flattening().run(F, BFI);
+  if (!modified)
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
 bool Flattening::runOnFunction(Function &F) {
+  BlockFrequencyInfo *BFI = nullptr;
+  if (needsFrequency())
+    BFI = &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+  return run(F, BFI);
+}
+
+bool Flattening::run(Function &F, BlockFrequencyInfo *BFI) {
+  ObfCache Cache("flattening", F,
+                 "dispatch=" + utostr(Dispatch) + ";hash=" +
+                     utostr(DenseHashFn) + ";ssa=" + utostr(KeepSSA) +
+                     ";copies=" + utostr(DispatchCopies) +
+                     ";scope=" + utostr(Scope) +
+                     ";switch=" + utostr(Switches) +
+                     ";transitions=" + utostr(Transitions) +
+                     ";layout=" + utostr(Layout) +
+                     ";chunk=" + utostr(ChunkBlocks) + "," +
+                     utostr(ChunkInsts) + ";" + profileOptions(F));
+  if (Cache.replay())
+    return true;
   Function *tmp = &F;
-  return flatten(tmp);
+  bool modified = flatten(tmp, BFI);
+  Cache.store();
+  return modified;
 }
 
-bool Flattening::flatten(Function *f) {
+bool Flattening::flatten(Function *f, BlockFrequencyInfo *BFI) {
   std::vector<BasicBlock *> origBB;
-  std::vector<uint32_t> bbIndex, bbHash;
-  BasicBlock *loopEntry;
-  LoadInst *load;
-  SwitchInst *switchI;
-  AllocaInst *switchVar, *hashVar;
-  std::random_device rd;
-  std::mt19937 g(rd());
-  IntegerType *i32 = Type::getInt32Ty(f->getContext());
-  ConstantInt *byteConst = ConstantInt::get(i32, 0xFF);
-  ConstantInt *primeConst = ConstantInt::get(i32, fnvPrime);
-  ConstantInt *basisConst = ConstantInt::get(i32, fnvBasis);
+  ObfRNG g = createRNG("flattening", *f);
+  // Separate stream, so that hash dispatch is unchanged
+  ObfRNG kg = createRNG("flattening.dense", *f);
 
   // Save all original BB
   for (Function::iterator i = f->begin(); i != f->end(); ++i) {
@@ -84,6 +315,16 @@ bool Flattening::flatten(Function *f) {
     return false;
   }
 
+  // Blocks too hot for the overhead budget keep their branches
+  SmallPtrSet<BasicBlock *, 16> hotBB = hotBlocks(*f, BFI);
+  if (hotBB.size() == origBB.size())
+    return false;
+  // Frequencies of the blocks as they are now, for the layout
+  blockFreq.clear();
+  if (Layout == BLHot)
+    for (BasicBlock &BB : *f)
+      blockFreq[&BB] = BFI->getBlockFreq(&BB).getFrequency();
+
   // Remove first BB
   origBB.erase(origBB.begin());
 
@@ -108,7 +349,323 @@ bool Flattening::flatten(Function *f) {
 
     BasicBlock *tmpBB = insert->splitBasicBlock(i, "first");
     origBB.insert(origBB.begin(), tmpBB);
+    blockFreq[tmpBB] = blockFreq.lookup(insert);
+  }
+
+  SmallPtrSet<Instruction *, 16> origAllocas;
+  for (Instruction &I : *insert)
+    if (isa<AllocaInst>(I))
+      origAllocas.insert(&I);
+  std::vector<AllocaInst *> stateVars;
+  size_t copyBudget = DispatchCopies;
+  IntegerType *i32 = Type::getInt32Ty(f->getContext());
+  transTable.clear();
+  if (Transitions == TMTable)
+    transVar = new GlobalVariable(*f->getParent(), i32, true,
+                                  GlobalValue::ExternalLinkage, nullptr,
+                                  "stateTable");
+
+  if (Scope == FSLoops) {
+    // Without phis, edges can be redirected freely
+    fixStack(f);
+    DominatorTree DT(*f);
+    LoopInfo LI(DT);
+    // Innermost loop of each block, null outside loops. Blocks created for
+    // a loop belong to it, except for its entry which belongs to the parent,
+    // and the blocks of loops left alone belong to the parent as well.
+    DenseMap<BasicBlock *, Loop *> level;
+    for (BasicBlock &BB : *f)
+      level[&BB] = LI.getLoopFor(&BB);
+    SmallVector<Loop *, 8> loops = LI.getLoopsInPreorder();
+    // Inner loops first, so that their blocks are out of the way
+    for (auto l = loops.rbegin(); l != loops.rend(); ++l) {
+      Loop *L = *l;
+      BasicBlock *header = L->getHeader();
+      std::vector<BasicBlock *> blocks{header};
+      for (BasicBlock &BB : *f)
+        if (level.lookup(&BB) == L && &BB != header && !hotBB.count(&BB))
+          blocks.push_back(&BB);
+      // Hot loops would go through the dispatcher on every iteration
+      if (blocks.size() < 2 || hotBB.count(header)) {
+        for (auto &BL : level)
+          if (BL.second == L)
+            BL.second = L->getParentLoop();
+        continue;
+      }
+      BasicBlock *entry =
+          BasicBlock::Create(f->getContext(), "loopRegion", f, header);
+      level[entry] = L->getParentLoop();
+      // The loop info predates the blocks that inner loops added
+      std::vector<BasicBlock *> preds(pred_begin(header), pred_end(header));
+      for (BasicBlock *pred : preds) {
+        Loop *predLoop = level.lookup(pred);
+        if (!predLoop || !L->contains(predLoop))
+          pred->getTerminator()->replaceUsesOfWith(header, entry);
+      }
+      BranchInst::Create(header, entry);
+      flattenRegion(f, entry, blocks, g, kg, copyBudget, stateVars);
+      for (BasicBlock &BB : *f)
+        if (!level.count(&BB))
+          level[&BB] = L;
+    }
+    origBB.clear();
+    for (BasicBlock &BB : *f)
+      if (!level.lookup(&BB) && &BB != insert)
+        origBB.push_back(&BB);
+  }
+  if (!hotBB.empty()) {
+    // Without phis, edges can be redirected freely
+    fixStack(f);
+    BasicBlock *first = insert->getTerminator()->getSuccessor(0);
+    if (hotBB.count(first)) {
+      // Enter through a block of its own, so that first keeps its branches
+      BasicBlock *entry =
+          BasicBlock::Create(f->getContext(), "flatRegion", f, first);
+      BranchInst::Create(first, entry);
+      insert->getTerminator()->replaceUsesOfWith(first, entry);
+      origBB.push_back(entry);
+      first = entry;
+    }
+    origBB.erase(std::remove_if(origBB.begin(), origBB.end(),
+                                [&](BasicBlock *BB) {
+                                  return BB != first && hotBB.count(BB);
+                                }),
+                 origBB.end());
+  }
+  if (origBB.size() >= 2)
+    flattenRegion(f, insert, origBB, g, kg, copyBudget, stateVars);
+
+  fixStack(f);
+
+  // The dispatch state becomes phis of loopEntry, so it stays in registers.
+  // So do the values fixStack demoted with -flattening-ssa, which then flow
+  // through loopEntry. Their reloads are volatile, which would pin them to
+  // the stack.
+  if (KeepSSA)
+    for (Instruction &I : *insert) {
+      AllocaInst *AI = dyn_cast<AllocaInst>(&I);
+      if (!AI || origAllocas.count(AI) ||
+          std::count(stateVars.begin(), stateVars.end(), AI))
+        continue;
+      for (User *U : AI->users())
+        if (LoadInst *LI = dyn_cast<LoadInst>(U))
+          LI->setVolatile(false);
+      if (isAllocaPromotable(AI))
+        stateVars.push_back(AI);
+    }
+  DominatorTree DT(*f);
+  PromoteMemToReg(stateVars, DT);
+
+  if (Transitions == TMTable) {
+    if (!transTable.empty()) {
+      Constant *init = ConstantDataArray::get(f->getContext(), transTable);
+      GlobalVariable *table = new GlobalVariable(
+          *f->getParent(), init->getType(), true, GlobalValue::PrivateLinkage,
+          init, "");
+      table->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+      // One cache line holds the entries of 8 to 16 transitions
+      table->setAlignment(64);
+      transVar->replaceAllUsesWith(
+          ConstantExpr::getBitCast(table, transVar->getType()));
+      table->takeName(transVar);
+    }
+    transVar->eraseFromParent();
+    transVar = nullptr;
+  }
+
+  return true;
+}
+
+// Order of the blocks of a level, the last next to the dispatcher. The
+// hottest blocks, up to 90% of the frequency of the level, come last in
+// chains of their likeliest hot successors, so that the transitions along
+// the hot paths stay within a few cache lines. The others keep the random
+// order of bbSeq. Blocks added by flattening count as cold.
+std::vector<size_t>
+Flattening::hotLayout(const std::vector<BasicBlock *> &origBB,
+                      const std::vector<size_t> &bbSeq) {
+  auto freq = [&](size_t b) { return blockFreq.lookup(origBB[b]); };
+  std::vector<size_t> byFreq = bbSeq;
+  std::stable_sort(byFreq.begin(), byFreq.end(),
+                   [&](size_t a, size_t b) { return freq(a) > freq(b); });
+  uint64_t total = 0, sum = 0;
+  for (size_t b : byFreq)
+    total += freq(b);
+  std::vector<bool> hot(origBB.size()), placed(origBB.size());
+  for (size_t b : byFreq) {
+    if (!freq(b) || sum >= total / 10 * 9)
+      break;
+    hot[b] = true;
+    sum += freq(b);
+  }
+
+  std::vector<size_t> order;
+  for (size_t b : bbSeq)
+    if (!hot[b])
+      order.push_back(b);
+  for (size_t b : byFreq) {
+    if (!hot[b])
+      break;
+    for (size_t c = b; c < origBB.size() && !placed[c];) {
+      order.push_back(c);
+      placed[c] = true;
+      size_t next = origBB.size();
+      for (BasicBlock *succ : successors(origBB[c])) {
+        size_t s = std::distance(origBB.begin(),
+                                 std::find(origBB.begin(), origBB.end(), succ));
+        if (s < origBB.size() && hot[s] && !placed[s] &&
+            (next == origBB.size() || freq(s) > freq(next)))
+          next = s;
+      }
+      c = next;
+    }
+  }
+  return order;
+}
+
+// Flattens origBB as flattenLevel does, or, if it is over the limits, each
+// chunk of consecutive blocks within them into a dispatcher of its own. The
+// ways into the chunks are then flattened into a dispatcher choosing the
+// chunk, so that a transition between chunks sets both states.
+void Flattening::flattenRegion(Function *f, BasicBlock *insert,
+                               std::vector<BasicBlock *> origBB, ObfRNG &g,
+                               ObfRNG &kg, size_t &copyBudget,
+                               std::vector<AllocaInst *> &stateVars) {
+  std::vector<std::vector<BasicBlock *>> chunks(1);
+  size_t insts = 0;
+  for (BasicBlock *BB : origBB) {
+    if (!chunks.back().empty() &&
+        ((ChunkBlocks && chunks.back().size() >= ChunkBlocks) ||
+         (ChunkInsts && insts + BB->size() > ChunkInsts))) {
+      chunks.emplace_back();
+      insts = 0;
+    }
+    chunks.back().push_back(BB);
+    insts += BB->size();
+  }
+  if (chunks.size() < 2) {
+    flattenLevel(f, insert, origBB, g, kg, copyBudget, stateVars);
+    return;
+  }
+  NumChunked++;
+
+  // Without phis, edges can be redirected freely
+  fixStack(f);
+  std::vector<BasicBlock *> topBB;
+  for (std::vector<BasicBlock *> &chunk : chunks) {
+    if (chunk.size() < 2) {
+      topBB.push_back(chunk[0]);
+      continue;
+    }
+    NumChunks++;
+    // Entered through its first block, or the enter blocks of the others
+    BasicBlock *entry =
+        BasicBlock::Create(f->getContext(), "chunk", f, chunk[0]);
+    std::vector<BasicBlock *> preds(pred_begin(chunk[0]), pred_end(chunk[0]));
+    for (BasicBlock *pred : preds)
+      if (!std::count(chunk.begin(), chunk.end(), pred))
+        pred->getTerminator()->replaceUsesOfWith(chunk[0], entry);
+    BranchInst::Create(chunk[0], entry);
+    std::vector<BasicBlock *> enters =
+        flattenLevel(f, entry, chunk, g, kg, copyBudget, stateVars);
+    topBB.push_back(entry);
+    topBB.insert(topBB.end(), enters.begin(), enters.end());
+  }
+  flattenLevel(f, insert, topBB, g, kg, copyBudget, stateVars);
+}
+
+// Change of state of a dense switch, read from a table indexed by the
+// condition minus the smallest case, with that of the default at the end.
+// Null if the switch is too sparse for a table.
+static Value *switchTable(SwitchInst *SI,
+                          function_ref<uint32_t(BasicBlock *)> delta) {
+  LLVMContext &ctx = SI->getContext();
+  Value *cond = SI->getCondition();
+  unsigned numCases = SI->getNumCases();
+  if (cond->getType()->getIntegerBitWidth() > 64 || numCases < 4)
+    return nullptr;
+  APInt lo = SI->case_begin()->getCaseValue()->getValue(), hi = lo;
+  for (auto &c : SI->cases()) {
+    const APInt &v = c.getCaseValue()->getValue();
+    if (v.slt(lo))
+      lo = v;
+    if (v.sgt(hi))
+      hi = v;
+  }
+  // At least a quarter of the entries are cases, as for jump tables
+  uint64_t range = (hi - lo).getZExtValue();
+  if (range >= 4 * uint64_t(numCases))
+    return nullptr;
+  range++;
+
+  std::vector<uint32_t> table(range + 1, delta(SI->getDefaultDest()));
+  for (auto &c : SI->cases())
+    table[(c.getCaseValue()->getValue() - lo).getZExtValue()] =
+        delta(c.getCaseSuccessor());
+  Constant *init = ConstantDataArray::get(ctx, ArrayRef<uint32_t>(table));
+  GlobalVariable *tableVar = new GlobalVariable(
+      *SI->getModule(), init->getType(), true, GlobalValue::PrivateLinkage,
+      init, "switchTable");
+  tableVar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+
+  IntegerType *i64 = Type::getInt64Ty(ctx);
+  Value *idx = BinaryOperator::Create(BinaryOperator::Sub, cond,
+                                      ConstantInt::get(ctx, lo), "", SI);
+  idx = CastInst::CreateZExtOrBitCast(idx, i64, "", SI);
+  Value *inRange = new ICmpInst(SI, ICmpInst::ICMP_ULT, idx,
+                                ConstantInt::get(i64, range));
+  idx = SelectInst::Create(inRange, idx, ConstantInt::get(i64, range), "", SI);
+  Value *idxs[] = {ConstantInt::get(i64, 0), idx};
+  Value *entry = GetElementPtrInst::CreateInBounds(tableVar->getValueType(),
+                                                   tableVar, idxs, "", SI);
+  return new LoadInst(Type::getInt32Ty(ctx), entry, "", SI);
+}
+
+// Flattens origBB into a dispatcher entered from insert, which must end with
+// an unconditional branch to one of them. Branches out of origBB are kept,
+// and branches into it from elsewhere go through the dispatcher, by way of
+// the blocks returned.
+std::vector<BasicBlock *>
+Flattening::flattenLevel(Function *f, BasicBlock *insert,
+                         std::vector<BasicBlock *> origBB, ObfRNG &g,
+                         ObfRNG &kg, size_t &copyBudget,
+                         std::vector<AllocaInst *> &stateVars) {
+  std::vector<uint32_t> bbIndex, bbHash;
+  BasicBlock *loopEntry;
+  LoadInst *load;
+  SwitchInst *switchI;
+  AllocaInst *switchVar, *hashVar;
+  IntegerType *i32 = Type::getInt32Ty(f->getContext());
+  ConstantInt *byteConst = ConstantInt::get(i32, 0xFF);
+  ConstantInt *primeConst = ConstantInt::get(i32, fnvPrime);
+  ConstantInt *basisConst = ConstantInt::get(i32, fnvBasis);
+
+  // Blocks branching out keep their branch. Conditional exits get a block
+  // of their own for that.
+  SmallPtrSet<BasicBlock *, 32> inLevel(origBB.begin(), origBB.end());
+  size_t numBlocks = origBB.size();
+  for (size_t b = 0; b < numBlocks; b++) {
+    Instruction *term = origBB[b]->getTerminator();
+    if (term->getNumSuccessors() < 2)
+      continue;
+    for (unsigned s = 0; s < term->getNumSuccessors(); s++) {
+      BasicBlock *succ = term->getSuccessor(s);
+      if (inLevel.count(succ))
+        continue;
+      BasicBlock *exit = BasicBlock::Create(f->getContext(), "exit", f);
+      BranchInst::Create(succ, exit);
+      term->setSuccessor(s, exit);
+      origBB.push_back(exit);
+      inLevel.insert(exit);
+    }
   }
+  // Entries other than insert, redirected once the states are known
+  std::vector<std::pair<BasicBlock *, size_t>> entries;
+  for (size_t b = 0; b < origBB.size(); b++)
+    for (BasicBlock *pred : predecessors(origBB[b]))
+      if (pred != insert && !inLevel.count(pred) &&
+          !std::count(entries.begin(), entries.end(), std::make_pair(pred, b)))
+        entries.push_back(std::make_pair(pred, b));
 
   std::uniform_int_distribution<uint32_t> rand(0, UINT32_MAX);
   for (size_t i = 0; i < origBB.size(); i++) {
@@ -125,17 +682,31 @@ bool Flattening::flatten(Function *f) {
   std::vector<size_t> bbSeq(origBB.size());
   std::iota(bbSeq.begin(), bbSeq.end(), 0);
   std::shuffle(bbSeq.begin(), bbSeq.end(), g);
+  DenseKey Key(kg);
+  if (Dispatch == DMDense)
+    for (size_t i = 0; i < bbSeq.size(); i++)
+      bbIndex[bbSeq[i]] = Key.unhash(i);
+
+  // Create switch variable, in the entry block so that it can be promoted
+  Instruction *allocaPt = f->getEntryBlock().getTerminator();
+  if (Dispatch == DMHash) {
+    hashVar = new AllocaInst(i32, 0, "hashVar", allocaPt);
+    stateVars.push_back(hashVar);
+  }
+  switchVar = new AllocaInst(i32, 0, "switchVar", allocaPt);
+  stateVars.push_back(switchVar);
 
   // Remove jump
   std::ptrdiff_t entryBlock = std::distance(
       origBB.begin(), std::find(origBB.begin(), origBB.end(),
                                 insert->getTerminator()->getSuccessor(0)));
+  assert(entryBlock < std::ptrdiff_t(origBB.size()) &&
+         "insert must branch into the level");
   insert->getTerminator()->eraseFromParent();
 
-  // Create switch variable and set as it
-  hashVar = new AllocaInst(i32, 0, "hashVar", insert);
-  new StoreInst(basisConst, hashVar, insert);
-  switchVar = new AllocaInst(i32, 0, "switchVar", insert);
+  // Set the initial state
+  if (Dispatch == DMHash)
+    new StoreInst(basisConst, hashVar, insert);
   new StoreInst(ConstantInt::get(i32, bbIndex[entryBlock]), switchVar, insert);
 
   // Create main loop
@@ -145,50 +716,106 @@ bool Flattening::flatten(Function *f) {
   insert->moveBefore(loopEntry);
   BranchInst::Create(loopEntry, insert);
 
-  // Calculate hash
   load = new LoadInst(switchVar, "switchVar", loopEntry);
-  BinaryOperator *dataVal =
-      BinaryOperator::Create(BinaryOperator::And, load,
-                             ConstantInt::get(i32, 0xFFFFFFFF), "", loopEntry);
-  BinaryOperator *hashVal = BinaryOperator::Create(
-      BinaryOperator::And, new LoadInst(hashVar, "hashVar", loopEntry),
-      ConstantInt::get(i32, 0xFFFFFFFF), "", loopEntry);
-  for (int i = 0; i < 4; i++) {
-    BinaryOperator *t = BinaryOperator::Create(BinaryOperator::And, dataVal,
-                                               byteConst, "", loopEntry);
-    hashVal =
-        BinaryOperator::Create(BinaryOperator::Xor, hashVal, t, "", loopEntry);
-    hashVal = BinaryOperator::Create(BinaryOperator::Mul, hashVal, primeConst,
-                                     "", loopEntry);
-    dataVal = BinaryOperator::Create(BinaryOperator::AShr, dataVal,
-                                     ConstantInt::get(i32, 8), "", loopEntry);
-  }
-  new StoreInst(hashVal, hashVar, loopEntry);
+  if (Dispatch == DMDense) {
+    switchI = SwitchInst::Create(Key.hash(load, loopEntry), loopEntry,
+                                 origBB.size(), loopEntry);
+    for (size_t i = 0; i < bbSeq.size(); i++) {
+      origBB[bbSeq[i]]->moveBefore(loopEntry);
+      switchI->addCase(ConstantInt::get(i32, i), origBB[bbSeq[i]]);
+    }
+  } else {
+    // Calculate hash
+    BinaryOperator *dataVal = BinaryOperator::Create(
+        BinaryOperator::And, load, ConstantInt::get(i32, 0xFFFFFFFF), "",
+        loopEntry);
+    BinaryOperator *hashVal = BinaryOperator::Create(
+        BinaryOperator::And, new LoadInst(hashVar, "hashVar", loopEntry),
+        ConstantInt::get(i32, 0xFFFFFFFF), "", loopEntry);
+    for (int i = 0; i < 4; i++) {
+      BinaryOperator *t = BinaryOperator::Create(BinaryOperator::And, dataVal,
+                                                 byteConst, "", loopEntry);
+      hashVal = BinaryOperator::Create(BinaryOperator::Xor, hashVal, t, "",
+                                       loopEntry);
+      hashVal = BinaryOperator::Create(BinaryOperator::Mul, hashVal, primeConst,
+                                       "", loopEntry);
+      dataVal = BinaryOperator::Create(BinaryOperator::AShr, dataVal,
+                                       ConstantInt::get(i32, 8), "", loopEntry);
+    }
+    new StoreInst(hashVal, hashVar, loopEntry);
 
-  switchI = SwitchInst::Create(hashVal, loopEntry, 0, loopEntry);
+    switchI = SwitchInst::Create(hashVal, loopEntry, 0, loopEntry);
 
-  // Put all BB in the switch
-  for (size_t b : bbSeq) {
-    BasicBlock *i = origBB[b];
-    ConstantInt *numCase = NULL;
+    // Put all BB in the switch
+    for (size_t b : bbSeq) {
+      BasicBlock *i = origBB[b];
+      ConstantInt *numCase = NULL;
 
-    // Move the BB inside the switch (only visual, no code logic)
-    i->moveBefore(loopEntry);
+      // Move the BB inside the switch (only visual, no code logic)
+      i->moveBefore(loopEntry);
 
-    // Add case to switch
-    numCase = cast<ConstantInt>(
-        ConstantInt::get(switchI->getCondition()->getType(), bbHash[b]));
-    switchI->addCase(numCase, i);
+      // Add case to switch
+      numCase = cast<ConstantInt>(
+          ConstantInt::get(switchI->getCondition()->getType(), bbHash[b]));
+      switchI->addCase(numCase, i);
+    }
   }
 
+  if (Layout == BLHot)
+    for (size_t b : hotLayout(origBB, bbSeq))
+      origBB[b]->moveBefore(loopEntry);
+
   // Recalculate switchVar
   for (size_t b : bbSeq) {
     BasicBlock *i = origBB[b];
     size_t succIndexTrue, succIndexFalse;
     Value *cond = nullptr;
 
-    // Ret BB
-    if (i->getTerminator()->getNumSuccessors() == 0) {
+    // Ret BB, or exit
+    if (i->getTerminator()->getNumSuccessors() == 0 ||
+        !inLevel.count(i->getTerminator()->getSuccessor(0))) {
+      continue;
+    }
+
+    // Switches keep their O(1) dispatch: dense ones look the change of state
+    // up in a table, the others branch to a block per successor setting it
+    if (SwitchInst *SI = dyn_cast<SwitchInst>(i->getTerminator())) {
+      uint32_t randomXor = rand(g);
+      auto delta = [&](BasicBlock *succ) {
+        size_t s = std::distance(origBB.begin(),
+                                 std::find(origBB.begin(), origBB.end(), succ));
+        return bbIndex[b] ^ bbIndex[s] ^ randomXor;
+      };
+      if (Value *d = switchTable(SI, delta)) {
+        Value *tempVal = BinaryOperator::Create(
+            BinaryOperator::Xor, ConstantInt::get(i32, randomXor),
+            new LoadInst(switchVar, "switchVar", SI), "", SI);
+        tempVal = BinaryOperator::Create(BinaryOperator::Xor, tempVal, d, "",
+                                         SI);
+        SI->eraseFromParent();
+        new StoreInst(tempVal, switchVar, i);
+        if (Dispatch == DMHash)
+          new StoreInst(basisConst, hashVar, i);
+        BranchInst::Create(loopEntry, i);
+        continue;
+      }
+      DenseMap<BasicBlock *, BasicBlock *> caseBB;
+      for (unsigned s = 0; s < SI->getNumSuccessors(); s++) {
+        BasicBlock *&stub = caseBB[SI->getSuccessor(s)];
+        if (!stub) {
+          stub = BasicBlock::Create(f->getContext(), "switchCase", f,
+                                    i->getNextNode());
+          BinaryOperator *tempVal = BinaryOperator::Create(
+              BinaryOperator::Xor,
+              ConstantInt::get(i32, delta(SI->getSuccessor(s)) ^ randomXor),
+              new LoadInst(switchVar, "switchVar", stub), "", stub);
+          new StoreInst(tempVal, switchVar, stub);
+          if (Dispatch == DMHash)
+            new StoreInst(basisConst, hashVar, stub);
+          BranchInst::Create(loopEntry, stub);
+        }
+        SI->setSuccessor(s, stub);
+      }
       continue;
     }
 
@@ -213,11 +840,45 @@ bool Flattening::flatten(Function *f) {
                                     i->getTerminator()->getSuccessor(0)));
     }
 
+    // The entries of the block hold the changes of state to its false and
+    // true successors, found from the state so that the index is opaque
+    if (Transitions == TMTable) {
+      Instruction *term = i->getTerminator();
+      bool conditional = term->getNumSuccessors() == 2;
+      uint32_t base = transTable.size();
+      transTable.push_back(bbIndex[b] ^ bbIndex[succIndexFalse]);
+      if (conditional)
+        transTable.push_back(bbIndex[b] ^ bbIndex[succIndexTrue]);
+      IntegerType *i64 = Type::getInt64Ty(f->getContext());
+      LoadInst *state = new LoadInst(switchVar, "switchVar", term);
+      Value *idx = BinaryOperator::Create(
+          BinaryOperator::Xor, state, ConstantInt::get(i32, bbIndex[b] ^ base),
+          "", term);
+      idx = new ZExtInst(idx, i64, "", term);
+      if (conditional)
+        idx = BinaryOperator::Create(BinaryOperator::Add, idx,
+                                     new ZExtInst(cond, i64, "", term), "",
+                                     term);
+      Value *entry = GetElementPtrInst::Create(i32, transVar, idx, "", term);
+      Value *tempVal =
+          BinaryOperator::Create(BinaryOperator::Xor, state,
+                                 new LoadInst(i32, entry, "", term), "", term);
+      term->eraseFromParent();
+      new StoreInst(tempVal, switchVar, i);
+      if (Dispatch == DMHash)
+        new StoreInst(basisConst, hashVar, i);
+      BranchInst::Create(loopEntry, i);
+      continue;
+    }
+
     std::vector<size_t> bbTemp = bbSeq;
     std::shuffle(bbTemp.begin(), bbTemp.end(), g);
     uint32_t randomXor = rand(g);
+    // Reload the state here rather than use that of loopEntry, so that it
+    // is not demoted to a stack slot of its own below
     BinaryOperator *tempVal = BinaryOperator::Create(
-        BinaryOperator::Xor, ConstantInt::get(i32, randomXor), load, "",
+        BinaryOperator::Xor, ConstantInt::get(i32, randomXor),
+        new LoadInst(switchVar, "switchVar", i->getTerminator()), "",
         i->getTerminator());
     int garbageCap = bbTemp.size() / 2;
     garbageCap = garbageCap > 1 ? garbageCap : 1;
@@ -250,13 +911,54 @@ bool Flattening::flatten(Function *f) {
     i->getTerminator()->eraseFromParent();
 
     // Update switchVar and jump to the end of loop
-    new StoreInst(tempVal, load->getPointerOperand(), i);
-    new StoreInst(basisConst, hashVar, i);
+    new StoreInst(tempVal, switchVar, i);
+    if (Dispatch == DMHash)
+      new StoreInst(basisConst, hashVar, i);
 
     BranchInst::Create(loopEntry, i);
   }
 
-  fixStack(f);
+  // Other entries set the state first
+  std::vector<BasicBlock *> enterBB(origBB.size(), nullptr);
+  for (auto &entry : entries) {
+    BasicBlock *&enter = enterBB[entry.second];
+    if (!enter) {
+      enter = BasicBlock::Create(f->getContext(), "enter", f, loopEntry);
+      new StoreInst(ConstantInt::get(i32, bbIndex[entry.second]), switchVar,
+                    enter);
+      if (Dispatch == DMHash)
+        new StoreInst(basisConst, hashVar, enter);
+      BranchInst::Create(loopEntry, enter);
+    }
+    entry.first->getTerminator()->replaceUsesOfWith(origBB[entry.second],
+                                                    enter);
+  }
 
-  return true;
+  // Give blocks a copy of the dispatcher of their own, as threaded
+  // interpreters do, so that its branches are predicted per source block
+  for (size_t b : bbSeq) {
+    BasicBlock *i = origBB[b];
+    if (loopEntry->size() > copyBudget)
+      break;
+    BranchInst *br = dyn_cast<BranchInst>(i->getTerminator());
+    if (!br || br->getSuccessor(0) != loopEntry)
+      continue;
+    copyBudget -= loopEntry->size();
+    ValueToValueMapTy VMap;
+    BasicBlock *copy = CloneBasicBlock(loopEntry, VMap, ".copy", f);
+    // Hash dispatch loops on its copy until the hash hits a case
+    VMap[loopEntry] = copy;
+    for (Instruction &I : *copy)
+      RemapInstruction(&I, VMap,
+                        RF_IgnoreMissingLocals | RF_NoModuleLevelChanges);
+    copy->moveAfter(i);
+    br->setSuccessor(0, copy);
+  }
+
+  std::vector<BasicBlock *> enters;
+  for (BasicBlock *enter : enterBB)
+    if (enter)
+      enters.push_back(enter);
+  return enters;
 }
+
@@ -12,6 +12,9 @@
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 
+#include "Cache.h"
+#include "Passes.h"
+
 #include <queue>
 #include <random>
 #include <vector>
@@ -228,7 +231,16 @@ char Func2Mod::ID = 0;
 static RegisterPass<Func2Mod> X("func2mod",
                                 "Extract functions to independent modules");
 
+PreservedAnalyses Func2ModPass::run(Module &M, ModuleAnalysisManager &AM) {
+  if (!Func2Mod().runOnModule(M))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
 bool Func2Mod::runOnModule(Module &M) {
+  ObfCache Cache("func2mod", M, utostr(NumOutputs));
+  if (Cache.replay(M.getModuleIdentifier()))
+    return true;
   for (Function &F : M) {
     if (F.getLinkage() == GlobalValue::InternalLinkage) {
       extractList.push_back(&F);
@@ -244,8 +256,10 @@ bool Func2Mod::runOnModule(Module &M) {
       if (F.getName() == "main")
         fname = "_main_";
     }
-    std::unique_ptr<ToolOutputFile> Out(new ToolOutputFile(
-        M.getModuleIdentifier() + fname + utostr(I++), EC, sys::fs::F_None));
+    std::string Name = fname + utostr(I++);
+    std::string Path = M.getModuleIdentifier() + Name;
+    std::unique_ptr<ToolOutputFile> Out(
+        new ToolOutputFile(Path, EC, sys::fs::F_None));
     if (EC) {
       errs() << EC.message() << '\n';
       exit(1);
@@ -256,6 +270,9 @@ bool Func2Mod::runOnModule(Module &M) {
 
     // Declare success.
     Out->keep();
+    Out->os().close();
+    Cache.storeFile(Name, Path);
   });
+  Cache.store();
   return true;
 }
\ No newline at end of file
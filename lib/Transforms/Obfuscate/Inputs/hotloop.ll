@@ -0,0 +1,72 @@
+; @work spends its time in the loop of %loop, %even and %latch, as its branch
+; weights and hotloop.proftext say. Its other blocks and @rare are cold.
+
+define i32 @work(i32 %n) {
+entry:
+  %odd = and i32 %n, 1
+  %isodd = icmp ne i32 %odd, 0
+  br i1 %isodd, label %setupodd, label %setupeven, !prof !0
+setupodd:
+  %s1 = mul i32 %n, 3
+  br label %loop
+setupeven:
+  %s2 = add i32 %n, 7
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %setupodd ], [ 0, %setupeven ], [ %inext, %latch ]
+  %h = phi i32 [ %s1, %setupodd ], [ %s2, %setupeven ], [ %h2, %latch ]
+  %h1 = mul i32 %h, 16777619
+  %bit = and i32 %h1, 1
+  %c = icmp eq i32 %bit, 0
+  br i1 %c, label %even, label %latch, !prof !0
+even:
+  %e1 = lshr i32 %h1, 7
+  %e2 = xor i32 %h1, %e1
+  %e3 = shl i32 %e2, 3
+  %h3 = add i32 %e2, %e3
+  br label %latch
+latch:
+  %h2 = phi i32 [ %h1, %loop ], [ %h3, %even ]
+  %inext = add i32 %i, 1
+  %more = icmp ult i32 %inext, 1000000
+  br i1 %more, label %loop, label %done, !prof !1
+done:
+  %big = icmp ugt i32 %h2, 100
+  br i1 %big, label %clamp, label %ret
+clamp:
+  %r1 = and i32 %h2, 63
+  br label %ret
+ret:
+  %r = phi i32 [ %r1, %clamp ], [ %h2, %done ]
+  ret i32 %r
+}
+
+define i32 @rare(i32 %n) {
+entry:
+  %a = icmp ult i32 %n, 10
+  br i1 %a, label %small, label %large
+small:
+  %s = add i32 %n, 100
+  br label %join
+large:
+  %b = icmp ult i32 %n, 50
+  br i1 %b, label %medium, label %join
+medium:
+  %m = sub i32 %n, 7
+  br label %join
+join:
+  %j = phi i32 [ %s, %small ], [ %m, %medium ], [ %n, %large ]
+  %r = xor i32 %j, 42
+  ret i32 %r
+}
+
+define i32 @main() {
+entry:
+  %w = call i32 @work(i32 3)
+  %r = call i32 @rare(i32 %w)
+  %x = and i32 %r, 255
+  ret i32 %x
+}
+
+!0 = !{!"branch_weights", i32 1, i32 1}
+!1 = !{!"branch_weights", i32 1000000, i32 1}
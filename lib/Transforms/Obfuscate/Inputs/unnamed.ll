@@ -0,0 +1,72 @@
+; Unnamed functions, which obfuscation passes key by their position in the
+; module, next to named ones that call them and a named one they call.
+
+@table = internal global [4 x i32] [i32 3, i32 1, i32 4, i32 1]
+
+define internal i32 @0(i32 %n) {
+entry:
+  %small = icmp ult i32 %n, 4
+  br i1 %small, label %load, label %loop
+load:
+  %p = getelementptr inbounds [4 x i32], [4 x i32]* @table, i32 0, i32 %n
+  %v = load i32, i32* %p
+  br label %done
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inext, %loop ]
+  %acc = phi i32 [ 17, %entry ], [ %acc2, %loop ]
+  %acc1 = mul i32 %acc, 31
+  %acc2 = xor i32 %acc1, %i
+  %inext = add i32 %i, 1
+  %more = icmp ult i32 %inext, %n
+  br i1 %more, label %loop, label %done
+done:
+  %r = phi i32 [ %v, %load ], [ %acc2, %loop ]
+  %m = call i32 @mix(i32 %r)
+  ret i32 %m
+}
+
+define i32 @mix(i32 %x) {
+entry:
+  %a = mul i32 %x, 2654435761
+  %b = lshr i32 %a, 13
+  %c = xor i32 %a, %b
+  %odd = and i32 %c, 1
+  %isodd = icmp ne i32 %odd, 0
+  br i1 %isodd, label %then, label %else
+then:
+  %t = add i32 %c, 12345
+  br label %join
+else:
+  %e = sub i32 %c, 678
+  br label %join
+join:
+  %r = phi i32 [ %t, %then ], [ %e, %else ]
+  ret i32 %r
+}
+
+define internal i32 @1(i32 %x, i32 %y) {
+entry:
+  %lt = icmp slt i32 %x, %y
+  br i1 %lt, label %less, label %more
+less:
+  %a = call i32 @0(i32 %x)
+  br label %join
+more:
+  %b = call i32 @0(i32 %y)
+  %b1 = add i32 %b, 99
+  br label %join
+join:
+  %r = phi i32 [ %a, %less ], [ %b1, %more ]
+  ret i32 %r
+}
+
+define i32 @main(i32 %argc, i8** %argv) {
+entry:
+  %a = call i32 @0(i32 2)
+  %b = call i32 @0(i32 100)
+  %c = call i32 @1(i32 %argc, i32 7)
+  %s1 = add i32 %a, %b
+  %s2 = xor i32 %s1, %c
+  %r = and i32 %s2, 255
+  ret i32 %r
+}
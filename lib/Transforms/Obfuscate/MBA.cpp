@@ -0,0 +1,744 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "MBA.h"
+#include "Util.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<double>
+    HotBudget("mba-hot-budget", cl::init(3),
+              cl::desc("Cycles an MBA rewrite may cost inside a loop"));
+static cl::opt<double>
+    ColdBudget("mba-cold-budget", cl::init(12),
+               cl::desc("Cycles an MBA rewrite may cost outside loops"));
+static cl::opt<double>
+    VMBudget("mba-vm-budget", cl::init(12),
+             cl::desc("Cycles the MBA rewrite of a VM handler may cost"));
+static cl::opt<std::string>
+    DBPath("mba-db", cl::init(""),
+           cl::desc("Identity database built by genMBA.py, used instead of "
+                    "the builtin identities for two-operand rewrites"));
+static cl::opt<bool>
+    VerifyMBA("mba-verify", cl::init(true),
+              cl::desc("Evaluate every MBA rewrite and constant split on "
+                       "random and corner inputs, and abort on a mismatch"));
+
+namespace {
+enum MBAFlags {
+  // Needs x only
+  MBAUnary = 1,
+  // Only holds for scalar i32
+  MBAScalar32 = 2
+};
+
+typedef Value *(*MBABuilder)(IRBuilder<> &Builder, Value *x, Value *y,
+                             ObfRNG &Generator);
+
+struct MBAIdentity {
+  MBAOp Op;
+  unsigned Flags;
+  // Skylake figures: 1 cycle latency for ALU ops and shifts, 3 for imul;
+  // 0.25 cycle reciprocal throughput for ALU ops, 0.5 for shifts, 1 for imul
+  MBACost Cost;
+  const char *Expr;
+  MBABuilder Build;
+};
+} // namespace
+
+static Constant *imm(Value *V, uint64_t C) {
+  return ConstantInt::get(V->getType(), C);
+}
+
+// p * ((x | any) & 0xFF)**2 cannot overflow 32 bits for p < 2**16
+static Value *primeSquare(IRBuilder<> &Builder, Value *x, ObfRNG &Generator,
+                          uint32_t p) {
+  std::uniform_int_distribution<uint64_t> RandAny(1, 255);
+  Value *temp = Builder.CreateOr(x, imm(x, RandAny(Generator)));
+  temp = Builder.CreateAnd(imm(x, 0xFF), temp);
+  temp = Builder.CreateMul(temp, temp);
+  return Builder.CreateMul(imm(x, p), temp);
+}
+
+static const MBAIdentity Identities[] = {
+    {MBAAdd, 0, {2, 0.75, 3}, "(x | y) + (x & y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateOr(x, y);
+       Value *b = Builder.CreateAnd(x, y);
+       return Builder.CreateAdd(a, b);
+     }},
+    {MBAAdd, 0, {3, 1.25, 4}, "(x ^ y) + ((x & y) << 1)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateXor(x, y);
+       Value *b = Builder.CreateAnd(x, y);
+       b = Builder.CreateShl(b, 1);
+       return Builder.CreateAdd(a, b);
+     }},
+    {MBAAdd, 0, {3, 1.25, 4}, "((x | y) << 1) - (x ^ y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateOr(x, y);
+       a = Builder.CreateShl(a, 1);
+       Value *b = Builder.CreateXor(x, y);
+       return Builder.CreateSub(a, b);
+     }},
+    {MBAAdd, 0, {5, 2.5, 10}, "(x | ~y) + (~x & y) - ~(x & y) + (x | y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateNot(y);
+       a = Builder.CreateOr(a, x);
+       Value *b = Builder.CreateNot(x);
+       b = Builder.CreateAnd(b, y);
+       Value *c = Builder.CreateAnd(x, y);
+       c = Builder.CreateNot(c);
+       Value *d = Builder.CreateOr(x, y);
+       Value *binOp = Builder.CreateAdd(a, b);
+       binOp = Builder.CreateSub(binOp, c);
+       return Builder.CreateAdd(binOp, d);
+     }},
+
+    {MBASub, 0, {3, 0.75, 3}, "x + ~y + 1",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateNot(y);
+       a = Builder.CreateAdd(x, a);
+       return Builder.CreateAdd(a, imm(x, 1));
+     }},
+    {MBASub, 0, {3, 1.25, 5}, "(x & ~y) - (~x & y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateNot(y);
+       a = Builder.CreateAnd(x, a);
+       Value *b = Builder.CreateNot(x);
+       b = Builder.CreateAnd(b, y);
+       return Builder.CreateSub(a, b);
+     }},
+    {MBASub, 0, {4, 1.5, 5}, "(x ^ y) - ((~x & y) << 1)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateXor(x, y);
+       Value *b = Builder.CreateNot(x);
+       b = Builder.CreateAnd(b, y);
+       b = Builder.CreateShl(b, 1);
+       return Builder.CreateSub(a, b);
+     }},
+
+    {MBAAnd, 0, {2, 0.75, 3}, "(x | y) - (x ^ y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateOr(x, y);
+       Value *b = Builder.CreateXor(x, y);
+       return Builder.CreateSub(a, b);
+     }},
+    {MBAAnd, 0, {2, 0.75, 3}, "(x + y) - (x | y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateAdd(x, y);
+       Value *b = Builder.CreateOr(x, y);
+       return Builder.CreateSub(a, b);
+     }},
+    {MBAAnd, 0, {4, 1.75, 7}, "(~x | y) + (x & ~y) - ~(x & y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateAnd(x, y);
+       a = Builder.CreateNot(a);
+       Value *b = Builder.CreateNot(x);
+       b = Builder.CreateOr(b, y);
+       Value *c = Builder.CreateNot(y);
+       c = Builder.CreateAnd(x, c);
+       Value *binOp = Builder.CreateAdd(b, c);
+       return Builder.CreateSub(binOp, a);
+     }},
+
+    {MBAOr, 0, {2, 0.75, 3}, "(x ^ y) + (x & y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateXor(x, y);
+       Value *b = Builder.CreateAnd(x, y);
+       return Builder.CreateAdd(a, b);
+     }},
+    {MBAOr, 0, {2, 0.75, 3}, "(x + y) - (x & y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateAdd(x, y);
+       Value *b = Builder.CreateAnd(x, y);
+       return Builder.CreateSub(a, b);
+     }},
+    {MBAOr, 0, {3, 1.25, 5}, "(x ^ y) + y - (~x & y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateXor(x, y);
+       Value *b = Builder.CreateNot(x);
+       b = Builder.CreateAnd(b, y);
+       Value *binOp = Builder.CreateAdd(a, y);
+       return Builder.CreateSub(binOp, b);
+     }},
+
+    {MBAXor, 0, {2, 0.75, 3}, "(x | y) - (x & y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateOr(x, y);
+       Value *b = Builder.CreateAnd(x, y);
+       return Builder.CreateSub(a, b);
+     }},
+    {MBAXor, 0, {3, 1.25, 4}, "x + y - ((x & y) << 1)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateAdd(x, y);
+       Value *b = Builder.CreateAnd(x, y);
+       b = Builder.CreateShl(b, 1);
+       return Builder.CreateSub(a, b);
+     }},
+    {MBAXor, 0, {3, 1.25, 4}, "((x | y) << 1) - (x + y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateOr(x, y);
+       a = Builder.CreateShl(a, 1);
+       Value *b = Builder.CreateAdd(x, y);
+       return Builder.CreateSub(a, b);
+     }},
+
+    {MBAZero, MBAUnary, {5, 1.75, 7},
+     "(((~x | 0x7AFAFA69) & 0xA061440) + ((x & 0x1050504) | 0x1010104)) ^ "
+     "185013572",
+     [](IRBuilder<> &Builder, Value *x, Value *, ObfRNG &) -> Value * {
+       Value *temp = Builder.CreateNot(x);
+       temp = Builder.CreateOr(temp, imm(x, 0x7AFAFA69));
+       temp = Builder.CreateAnd(temp, imm(x, 0xA061440));
+       Value *replaced = Builder.CreateAnd(x, imm(x, 0x1050504));
+       replaced = Builder.CreateOr(replaced, imm(x, 0x1010104));
+       replaced = Builder.CreateAdd(replaced, temp);
+       return Builder.CreateXor(replaced, imm(x, 185013572));
+     }},
+    {MBAZero, 0, {3, 1.25, 5}, "(x + y) - (x | y) - (x & y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateAdd(x, y);
+       Value *b = Builder.CreateOr(x, y);
+       a = Builder.CreateSub(a, b);
+       b = Builder.CreateAnd(x, y);
+       return Builder.CreateSub(a, b);
+     }},
+    {MBAZero, 0, {3, 1.75, 6}, "((x + y) - (x ^ y)) ^ ((x & y) << 1)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *replaced = Builder.CreateAdd(x, y);
+       Value *temp = Builder.CreateXor(x, y);
+       replaced = Builder.CreateSub(replaced, temp);
+       temp = Builder.CreateAnd(x, y);
+       temp = Builder.CreateShl(temp, 1);
+       return Builder.CreateXor(replaced, temp);
+     }},
+    {MBAZero, 0, {3, 1.25, 5}, "(x ^ y) - (x | y) + (x & y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateXor(x, y);
+       Value *b = Builder.CreateOr(x, y);
+       a = Builder.CreateSub(a, b);
+       b = Builder.CreateAnd(x, y);
+       return Builder.CreateAdd(a, b);
+     }},
+    {MBAZero, 0, {3, 1.25, 5}, "((x | y) - (x & y)) ^ (x ^ y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateOr(x, y);
+       Value *b = Builder.CreateAnd(x, y);
+       a = Builder.CreateSub(a, b);
+       b = Builder.CreateXor(x, y);
+       return Builder.CreateXor(a, b);
+     }},
+    {MBAZero, 0, {3, 1.5, 6}, "((x | y) - y) - (x & ~y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateOr(x, y);
+       a = Builder.CreateSub(a, y);
+       Value *b = Builder.CreateNot(y);
+       b = Builder.CreateAnd(x, b);
+       return Builder.CreateSub(a, b);
+     }},
+    {MBAZero, 0, {7, 4.5, 12},
+     "((x ^ y) - (x | ~y) + 3 * ~(x | y)) ^ (2 * ~x - y)",
+     [](IRBuilder<> &Builder, Value *x, Value *y, ObfRNG &) -> Value * {
+       Value *a = Builder.CreateNot(y);
+       a = Builder.CreateOr(x, a);
+       Value *b = Builder.CreateOr(x, y);
+       b = Builder.CreateNot(b);
+       b = Builder.CreateMul(b, imm(x, -3));
+       Value *c = Builder.CreateNot(x);
+       c = Builder.CreateMul(c, imm(x, 2));
+       c = Builder.CreateSub(c, y);
+       Value *replaced = Builder.CreateXor(x, y);
+       replaced = Builder.CreateSub(replaced, a);
+       replaced = Builder.CreateSub(replaced, b);
+       return Builder.CreateXor(replaced, c);
+     }},
+    {MBAZero, MBAScalar32, {10, 5.5, 10},
+     "sext(p1 * ((x | a) & 0xFF)**2 == p2 * ((y | b) & 0xFF)**2)",
+     [](IRBuilder<> &Builder, Value *x, Value *y,
+        ObfRNG &Generator) -> Value * {
+       // p1*(x|any)**2 != p2*(y|any)**2
+       uint32_t randp1 = randPrime(1 << 8, 1 << 16, Generator);
+       uint32_t randp2 = randPrime(1 << 8, 1 << 16, Generator);
+       while (randp1 == randp2)
+         randp2 = randPrime(1 << 8, 1 << 16, Generator);
+       Value *LhsTot = primeSquare(Builder, x, Generator, randp1);
+       Value *RhsTot = primeSquare(Builder, y, Generator, randp2);
+       Value *comp = Builder.CreateICmp(CmpInst::ICMP_EQ, LhsTot, RhsTot);
+       return Builder.CreateSExt(comp, x->getType());
+     }},
+};
+
+namespace {
+// Database written by genMBA.py, see there for the layout. The file is mapped
+// and an entry is only decoded when it is picked.
+class MBADatabase {
+public:
+  bool load(StringRef Path);
+  // nullptr if no cost class fits the budget
+  Value *build(MBAOp Op, Value *X, Value *Y, IRBuilder<> &Builder,
+               double Budget, ObfRNG &Generator) const;
+  // MD5 of the file
+  StringRef digest() const { return Digest; }
+
+private:
+  enum { NumOps = MBAZero + 1, NumClasses = 4, HeaderSize = 16,
+         IndexSize = NumOps * NumClasses * 8, EntrySize = 12 };
+  enum { DBX, DBY, DBConst, DBNot, DBAnd, DBOr, DBXor, DBAdd, DBSub, DBMul };
+  // Same as classBounds in genMBA.py
+  const double ClassBounds[NumClasses] = {3, 6, 12, 24};
+
+  std::unique_ptr<MemoryBuffer> Buffer;
+  const uint8_t *Index = nullptr;
+  const uint8_t *Entries = nullptr;
+  const uint8_t *Code = nullptr;
+  uint32_t NumEntries = 0;
+  uint32_t CodeSize = 0;
+  SmallString<32> Digest;
+};
+} // namespace
+
+bool MBADatabase::load(StringRef Path) {
+  using namespace support::endian;
+  auto BufferOrErr = MemoryBuffer::getFile(Path, -1, false);
+  if (!BufferOrErr)
+    return false;
+  Buffer = std::move(*BufferOrErr);
+  const uint8_t *Data =
+      reinterpret_cast<const uint8_t *>(Buffer->getBufferStart());
+  size_t Size = Buffer->getBufferSize();
+  if (Size < HeaderSize || memcmp(Data, "MBADB01", 8))
+    return false;
+  NumEntries = read32le(Data + 8);
+  CodeSize = read32le(Data + 12);
+  if (Size < HeaderSize + IndexSize + uint64_t(NumEntries) * EntrySize +
+                 CodeSize)
+    return false;
+  Index = Data + HeaderSize;
+  Entries = Index + IndexSize;
+  Code = Entries + NumEntries * EntrySize;
+  for (unsigned i = 0; i < NumOps * NumClasses; i++)
+    if (uint64_t(read32le(Index + i * 8)) + read32le(Index + i * 8 + 4) >
+        NumEntries)
+      return false;
+  MD5 Hash;
+  Hash.update(Buffer->getBuffer());
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  MD5::stringifyResult(Result, Digest);
+  return true;
+}
+
+Value *MBADatabase::build(MBAOp Op, Value *X, Value *Y, IRBuilder<> &Builder,
+                          double Budget,
+                          ObfRNG &Generator) const {
+  using namespace support::endian;
+  unsigned Fit[NumClasses], NumFit = 0;
+  for (unsigned c = 0; c < NumClasses; c++)
+    if (ClassBounds[c] <= Budget &&
+        read32le(Index + (Op * NumClasses + c) * 8 + 4))
+      Fit[NumFit++] = c;
+  if (!NumFit)
+    return nullptr;
+  std::uniform_int_distribution<unsigned> RandClass(0, NumFit - 1);
+  const uint8_t *Range =
+      Index + (Op * NumClasses + Fit[RandClass(Generator)]) * 8;
+  std::uniform_int_distribution<uint32_t> RandEntry(0, read32le(Range + 4) - 1);
+  const uint8_t *Entry =
+      Entries + (read32le(Range) + RandEntry(Generator)) * EntrySize;
+  uint32_t Len = read16le(Entry + 6);
+  uint32_t Offset = read32le(Entry + 8);
+  if (uint64_t(Offset) + Len > CodeSize)
+    report_fatal_error(Twine("Malformed MBA database ") + DBPath);
+
+  const uint8_t *C = Code + Offset;
+  std::vector<Value *> Stack;
+  for (uint32_t i = 0; i < Len;) {
+    uint8_t Ins = C[i++];
+    if (Ins == DBX || Ins == DBY) {
+      Stack.push_back(Ins == DBX ? X : Y);
+    } else if (Ins == DBConst && i + 8 <= Len) {
+      Stack.push_back(ConstantInt::get(X->getType(), read64le(C + i)));
+      i += 8;
+    } else if (Ins == DBNot && !Stack.empty()) {
+      Stack.back() = Builder.CreateNot(Stack.back());
+    } else if (Ins >= DBAnd && Ins <= DBMul && Stack.size() >= 2) {
+      static const Instruction::BinaryOps Opcodes[] = {
+          Instruction::And, Instruction::Or,  Instruction::Xor,
+          Instruction::Add, Instruction::Sub, Instruction::Mul};
+      Value *b = Stack.back();
+      Stack.pop_back();
+      Stack.back() = Builder.CreateBinOp(Opcodes[Ins - DBAnd], Stack.back(), b);
+    } else {
+      report_fatal_error(Twine("Malformed MBA database ") + DBPath);
+    }
+  }
+  if (Stack.size() != 1)
+    report_fatal_error(Twine("Malformed MBA database ") + DBPath);
+  return Stack.back();
+}
+
+// Opened on first use, once per process
+static const MBADatabase *getDatabase() {
+  static std::unique_ptr<MBADatabase> DB = []() {
+    std::unique_ptr<MBADatabase> DB;
+    if (DBPath.empty())
+      return DB;
+    DB.reset(new MBADatabase());
+    if (!DB->load(DBPath))
+      report_fatal_error(Twine("Cannot load MBA database ") + DBPath);
+    return DB;
+  }();
+  return DB.get();
+}
+
+namespace {
+// Evaluates integer expressions on a batch of inputs at once. The operations
+// an expression depends on are numbered first, in a flat array; each is then
+// a loop over Chunk inputs, writing to its own slice of a single buffer, that
+// the host compiler vectorizes. Values the evaluator does not handle, and
+// those it is told to, are unknowns that take every input in turn. Vectors
+// are evaluated one lane at a time.
+class MBAEvaluator {
+public:
+  enum { NumInputs = 1024, Chunk = 16 };
+  explicit MBAEvaluator(unsigned Lane) : Lane(Lane) {}
+  // Number of V once added with what it depends on, -1 if it cannot be
+  // evaluated. Values in Unknowns are not looked into.
+  int add(Value *V, const std::unordered_set<Value *> &Unknowns);
+  // Evaluates everything added on inputs First to First + Chunk - 1
+  void run(unsigned First);
+  const uint64_t *result(int Node) const { return &Buffer[Node * Chunk]; }
+
+private:
+  enum { Unknown = ~0U, Const = ~1U };
+  struct Node {
+    unsigned Opcode;
+    int A, B;
+    // Bits of the result, and the value of a constant or the index of an
+    // unknown
+    unsigned Bits;
+    uint64_t Imm;
+  };
+  unsigned Lane;
+  unsigned NumUnknowns = 0;
+  std::vector<Node> Nodes;
+  DenseMap<Value *, int> Index;
+  std::vector<uint64_t> Buffer;
+
+  static uint64_t input(unsigned Which, unsigned i);
+};
+} // namespace
+
+// Every pair of corner values for the first two unknowns, then values from a
+// fixed seed
+uint64_t MBAEvaluator::input(unsigned Which, unsigned i) {
+  static const uint64_t Corners[] = {
+      0,          1,          2,          3,
+      UINT64_MAX, UINT64_MAX - 1,         1ULL << 63,
+      (1ULL << 63) - 1,       0x80,       0x7F,
+      0xFF,       0x8000,     0x7FFF,     0xFFFF,
+      0x80000000, 0x7FFFFFFF, 0xFFFFFFFF, 0x5555555555555555,
+      0xAAAAAAAAAAAAAAAA,     0x0123456789ABCDEF};
+  const unsigned NumCorners = sizeof(Corners) / sizeof(Corners[0]);
+  if (Which < 2 && i < NumCorners * NumCorners)
+    return Corners[Which ? i % NumCorners : i / NumCorners];
+  // splitmix64
+  uint64_t z = (uint64_t(Which) << 32 | i) * 0x9E3779B97F4A7C15ULL + 0x114514;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+int MBAEvaluator::add(Value *V, const std::unordered_set<Value *> &Unknowns) {
+  auto It = Index.find(V);
+  if (It != Index.end())
+    return It->second;
+  Type *Ty = V->getType();
+  if (!Ty->isIntOrIntVectorTy() || Ty->getScalarSizeInBits() > 64)
+    return -1;
+  Node N = {Unknown, -1, -1, Ty->getScalarSizeInBits(), 0};
+
+  if (Unknowns.count(V)) {
+    // Looked up first, so that an unknown constant is still unknown
+  } else if (Constant *C = dyn_cast<Constant>(V)) {
+    if (Ty->isVectorTy())
+      C = C->getAggregateElement(Lane);
+    ConstantInt *CI = dyn_cast_or_null<ConstantInt>(C);
+    if (!CI)
+      return -1;
+    N.Opcode = Const;
+    N.Imm = CI->getZExtValue();
+  } else if (BinaryOperator *BO = dyn_cast<BinaryOperator>(V)) {
+    switch (BO->getOpcode()) {
+    case Instruction::Add:
+    case Instruction::Sub:
+    case Instruction::Mul:
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+    case Instruction::Shl:
+    case Instruction::LShr:
+    case Instruction::AShr:
+      N.Opcode = BO->getOpcode();
+      N.A = add(BO->getOperand(0), Unknowns);
+      N.B = N.A < 0 ? -1 : add(BO->getOperand(1), Unknowns);
+      if (N.B < 0)
+        return -1;
+      break;
+    default:
+      break;
+    }
+  } else if (ICmpInst *CI = dyn_cast<ICmpInst>(V)) {
+    if (CI->isEquality()) {
+      N.Opcode = CI->getPredicate();
+      N.A = add(CI->getOperand(0), Unknowns);
+      N.B = N.A < 0 ? -1 : add(CI->getOperand(1), Unknowns);
+      if (N.B < 0)
+        return -1;
+    }
+  } else if (CastInst *CI = dyn_cast<CastInst>(V)) {
+    if (CI->getOpcode() == Instruction::Trunc ||
+        CI->getOpcode() == Instruction::ZExt ||
+        CI->getOpcode() == Instruction::SExt) {
+      N.Opcode = CI->getOpcode();
+      N.A = add(CI->getOperand(0), Unknowns);
+      if (N.A < 0)
+        return -1;
+    }
+  }
+  if (N.Opcode == Unknown)
+    N.Imm = NumUnknowns++;
+  Nodes.push_back(N);
+  return Index[V] = Nodes.size() - 1;
+}
+
+void MBAEvaluator::run(unsigned First) {
+  Buffer.resize(Nodes.size() * Chunk);
+  for (size_t n = 0; n < Nodes.size(); n++) {
+    const Node &N = Nodes[n];
+    uint64_t Mask = bitMask(N.Bits);
+    uint64_t *r = &Buffer[n * Chunk];
+    const uint64_t *a = N.A < 0 ? nullptr : &Buffer[N.A * Chunk];
+    const uint64_t *b = N.B < 0 ? nullptr : &Buffer[N.B * Chunk];
+    switch (N.Opcode) {
+    case Unknown:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = input(N.Imm, First + i) & Mask;
+      break;
+    case Const:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = N.Imm;
+      break;
+    case Instruction::Add:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = (a[i] + b[i]) & Mask;
+      break;
+    case Instruction::Sub:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = (a[i] - b[i]) & Mask;
+      break;
+    case Instruction::Mul:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = (a[i] * b[i]) & Mask;
+      break;
+    case Instruction::And:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = a[i] & b[i];
+      break;
+    case Instruction::Or:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = a[i] | b[i];
+      break;
+    case Instruction::Xor:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = a[i] ^ b[i];
+      break;
+    // Out of range shifts are poison, any result will do
+    case Instruction::Shl:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = (a[i] << (b[i] & 63)) & Mask;
+      break;
+    case Instruction::LShr:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = a[i] >> (b[i] & 63);
+      break;
+    case Instruction::AShr: {
+      uint64_t Sign = 1ULL << (N.Bits - 1);
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = ((int64_t)((a[i] ^ Sign) - Sign) >> (b[i] & 63)) & Mask;
+      break;
+    }
+    case CmpInst::ICMP_EQ:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = a[i] == b[i];
+      break;
+    case CmpInst::ICMP_NE:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = a[i] != b[i];
+      break;
+    case Instruction::Trunc:
+    case Instruction::ZExt:
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = a[i] & Mask;
+      break;
+    case Instruction::SExt: {
+      uint64_t Sign = 1ULL << (Nodes[N.A].Bits - 1);
+      for (unsigned i = 0; i < Chunk; i++)
+        r[i] = ((a[i] ^ Sign) - Sign) & Mask;
+      break;
+    }
+    default:
+      llvm_unreachable("Unknown evaluator node");
+    }
+  }
+}
+
+// V must compute X Op Y in every lane, for any X and Y
+static bool checkMBA(Value *V, MBAOp Op, Value *X, Value *Y) {
+  unsigned Lanes =
+      V->getType()->isVectorTy() ? V->getType()->getVectorNumElements() : 1;
+  uint64_t Mask = bitMask(V->getType()->getScalarSizeInBits());
+  std::unordered_set<Value *> Unknowns = {X, Y};
+  for (unsigned l = 0; l < Lanes; l++) {
+    MBAEvaluator E(l);
+    int x = E.add(X, Unknowns);
+    int y = Y ? E.add(Y, Unknowns) : x;
+    int r = E.add(V, Unknowns);
+    if (r < 0 || x < 0)
+      return true;
+    uint64_t Diff = 0;
+    for (unsigned First = 0; First < MBAEvaluator::NumInputs;
+         First += MBAEvaluator::Chunk) {
+      E.run(First);
+      const uint64_t *xs = E.result(x), *ys = E.result(y), *rs = E.result(r);
+      for (unsigned i = 0; i < MBAEvaluator::Chunk; i++) {
+        uint64_t Expected;
+        switch (Op) {
+        case MBAAdd:
+          Expected = xs[i] + ys[i];
+          break;
+        case MBASub:
+          Expected = xs[i] - ys[i];
+          break;
+        case MBAAnd:
+          Expected = xs[i] & ys[i];
+          break;
+        case MBAOr:
+          Expected = xs[i] | ys[i];
+          break;
+        case MBAXor:
+          Expected = xs[i] ^ ys[i];
+          break;
+        default:
+          Expected = 0;
+        }
+        Diff |= (Expected & Mask) ^ rs[i];
+      }
+    }
+    if (Diff)
+      return false;
+  }
+  return true;
+}
+
+// One evaluator for all of them, as the zeros of a split are often built
+// from those of earlier ones
+void verifyConstants(ArrayRef<std::pair<Value *, Constant *>> Splits,
+                     const std::unordered_set<Value *> &Unknowns) {
+  if (!VerifyMBA)
+    return;
+  unsigned Lanes = 1;
+  for (auto &S : Splits) {
+    Type *Ty = S.first->getType();
+    if (Ty->isVectorTy())
+      Lanes = std::max(Lanes, Ty->getVectorNumElements());
+  }
+  for (unsigned l = 0; l < Lanes; l++) {
+    MBAEvaluator E(l);
+    std::vector<std::pair<int, uint64_t>> Roots;
+    for (auto &S : Splits) {
+      Type *Ty = S.first->getType();
+      if (l >= (Ty->isVectorTy() ? Ty->getVectorNumElements() : 1))
+        continue;
+      Constant *Lane =
+          Ty->isVectorTy() ? S.second->getAggregateElement(l) : S.second;
+      int r = E.add(S.first, Unknowns);
+      if (r >= 0 && isa<ConstantInt>(Lane))
+        Roots.push_back(
+            std::make_pair(r, cast<ConstantInt>(Lane)->getZExtValue()));
+    }
+    uint64_t Diff = 0;
+    for (unsigned First = 0; First < MBAEvaluator::NumInputs;
+         First += MBAEvaluator::Chunk) {
+      E.run(First);
+      for (auto &R : Roots) {
+        const uint64_t *rs = E.result(R.first);
+        for (unsigned i = 0; i < MBAEvaluator::Chunk; i++)
+          Diff |= rs[i] ^ R.second;
+      }
+    }
+    if (Diff)
+      report_fatal_error("Wrong constant split");
+  }
+}
+
+Value *buildMBA(MBAOp Op, Value *X, Value *Y, IRBuilder<> &Builder,
+                double Budget, ObfRNG &Generator) {
+  if (Y)
+    if (const MBADatabase *DB = getDatabase())
+      if (Value *V = DB->build(Op, X, Y, Builder, Budget, Generator)) {
+        if (VerifyMBA && !checkMBA(V, Op, X, Y))
+          report_fatal_error(Twine("Wrong MBA identity in ") + DBPath);
+        return V;
+      }
+
+  std::vector<const MBAIdentity *> Fit;
+  const MBAIdentity *Cheapest = nullptr;
+  for (const MBAIdentity &Id : Identities) {
+    if (Id.Op != Op || (!Y && !(Id.Flags & MBAUnary)))
+      continue;
+    if ((Id.Flags & MBAScalar32) && !X->getType()->isIntegerTy(32))
+      continue;
+    if (!Cheapest || Id.Cost.cycles() < Cheapest->Cost.cycles())
+      Cheapest = &Id;
+    if (Id.Cost.cycles() <= Budget)
+      Fit.push_back(&Id);
+  }
+  assert(Cheapest && "No identity for this operation");
+  const MBAIdentity *Id = Cheapest;
+  if (!Fit.empty()) {
+    std::uniform_int_distribution<size_t> Rand(0, Fit.size() - 1);
+    Id = Fit[Rand(Generator)];
+  }
+  Value *V = Id->Build(Builder, X, Y, Generator);
+  if (VerifyMBA && !checkMBA(V, Op, X, Y))
+    report_fatal_error(Twine("Wrong MBA identity ") + Id->Expr);
+  return V;
+}
+
+double mbaBudget(bool Hot) { return Hot ? HotBudget : ColdBudget; }
+
+double mbaVMBudget() { return VMBudget; }
+
+std::string mbaOptions() {
+  std::string Options = "hot=" + std::to_string(HotBudget) +
+                        ";cold=" + std::to_string(ColdBudget) +
+                        ";vm=" + std::to_string(VMBudget);
+  if (const MBADatabase *DB = getDatabase())
+    Options += (";db=" + DB->digest()).str();
+  return Options;
+}
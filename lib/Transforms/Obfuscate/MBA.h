@@ -0,0 +1,47 @@
+#ifndef LLVM_TRANSFORMS_OBFUSCATE_MBA_H
+#define LLVM_TRANSFORMS_OBFUSCATE_MBA_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/IRBuilder.h"
+
+#include "Util.h"
+
+#include <string>
+#include <unordered_set>
+#include <utility>
+
+// Operations the MBA library can rewrite. MBAZero builds an opaque zero of
+// the type of its operands.
+enum MBAOp { MBAAdd, MBASub, MBAAnd, MBAOr, MBAXor, MBAZero };
+
+// x86-64 cost of an identity, as emitted before any folding: latency of the
+// critical path and reciprocal throughput in cycles, and instruction count.
+struct MBACost {
+  unsigned Latency;
+  double RThroughput;
+  unsigned NumInsts;
+  double cycles() const {
+    return RThroughput > Latency ? RThroughput : Latency;
+  }
+};
+
+// Build x Op y, or a zero from x and y (y may be null for MBAZero), with an
+// identity picked at random among those costing at most Budget cycles. The
+// cheapest applicable identity is used if none fits.
+llvm::Value *buildMBA(MBAOp Op, llvm::Value *X, llvm::Value *Y,
+                      llvm::IRBuilder<> &Builder, double Budget,
+                      ObfRNG &Generator);
+// Checks, unless -mba-verify=false, that each split value evaluates to its
+// constant in every lane, whatever the values in Unknowns and those it
+// cannot look into
+void verifyConstants(
+    llvm::ArrayRef<std::pair<llvm::Value *, llvm::Constant *>> Splits,
+    const std::unordered_set<llvm::Value *> &Unknowns);
+// Per-site cycle budget, for code inside loops or for the rest
+double mbaBudget(bool Hot);
+// Cycle budget of the VM handlers
+double mbaVMBudget();
+// Fingerprint of the options above, for the cache key of passes using MBA
+std::string mbaOptions();
+
+#endif
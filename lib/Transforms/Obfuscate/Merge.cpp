@@ -5,6 +5,10 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
+#include "Cache.h"
+#include "Passes.h"
+#include "Util.h"
+
 #include <random>
 #include <vector>
 
@@ -16,6 +20,7 @@ struct Merge : public ModulePass {
   Merge() : ModulePass(ID) {}
 
   bool runOnModule(Module &M) override;
+  bool merge(Module &M);
 
   std::vector<Function *> mergeList;
 };
@@ -24,7 +29,22 @@ struct Merge : public ModulePass {
 char Merge::ID = 0;
 static RegisterPass<Merge> X("merge", "Merge static functions");
 
+PreservedAnalyses MergePass::run(Module &M, ModuleAnalysisManager &AM) {
+  if (!Merge().runOnModule(M))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
 bool Merge::runOnModule(Module &M) {
+  ObfCache Cache("merge", M, "");
+  if (Cache.replay())
+    return true;
+  bool modified = merge(M);
+  Cache.store();
+  return modified;
+}
+
+bool Merge::merge(Module &M) {
   for (Function &F : M) {
     if (F.getLinkage() == GlobalValue::InternalLinkage && !F.isVarArg() &&
         (F.getReturnType()->isIntOrPtrTy() || F.getReturnType()->isVoidTy())) {
@@ -38,8 +58,7 @@ bool Merge::runOnModule(Module &M) {
   size_t retBitLen = 64;
   std::string funcName = "";
   std::vector<uint32_t> funcID;
-  std::random_device rd;
-  std::mt19937 g(rd());
+  ObfRNG g = createRNG("merge", M);
   std::uniform_int_distribution<uint32_t> rand(0, UINT32_MAX);
   std::vector<Type *> paramTy;
   int ni32 = 0, ni64 = 0;
@@ -6,6 +6,9 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/ADT/Triple.h"
 
+#include "Passes.h"
+#include "Util.h"
+
 #include <vector>
 #include <random>
 
@@ -23,12 +26,17 @@ namespace {
 char ObfCall::ID = 0;
 static RegisterPass<ObfCall> X("obfCall", "Obfuscate calling convention for static functions");
 
+PreservedAnalyses ObfCallPass::run(Module &M, ModuleAnalysisManager &AM) {
+  if (!ObfCall().runOnModule(M))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
 bool ObfCall::runOnModule(Module &M){
   bool modified = false;
   Triple::ArchType at = Triple(M.getTargetTriple()).getArch();
   if(at == Triple::x86_64 || at == Triple::x86){
-    std::random_device rd;
-    std::mt19937 g(rd());
+    ObfRNG g = createRNG("obfCall", M);
     std::uniform_int_distribution<CallingConv::ID> rand(CallingConv::OBF_CALL_START, CallingConv::OBF_CALL_END);
     for(Function &F: M){
       CallingConv::ID obfCC = rand(g);
@@ -1,12 +1,23 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 
-
+#include "Cache.h"
+#include "MBA.h"
+#include "Passes.h"
 #include "Util.h"
 
+#include <algorithm>
+#include <map>
 #include <random>
 #include <unordered_set>
 #include <vector>
@@ -14,26 +25,96 @@
 
 using namespace llvm;
 
+enum TripCountPolicy { TCKeep, TCHoist, TCInline };
+enum ConstMode { CMMBA, CMTable };
+
+static cl::opt<ConstMode> Mode(
+    "obfcon-mode", cl::init(CMMBA),
+    cl::desc("How non-zero constants are hidden"),
+    cl::values(clEnumValN(CMMBA, "mba", "Split them into an MBA expression"),
+               clEnumValN(CMTable, "table",
+                          "Load them from a scrambled per-function table")));
+
+static cl::opt<bool>
+    LoopAware("obfcon-loop-aware", cl::init(false),
+              cl::desc("Materialize obfuscated constants used in loops once "
+                       "in the loop preheader"));
+static cl::opt<TripCountPolicy> TripCount(
+    "obfcon-trip-count", cl::init(TCKeep),
+    cl::desc("How -obfcon-loop-aware treats constants defining a trip count"),
+    cl::values(clEnumValN(TCKeep, "keep", "Leave them in the clear"),
+               clEnumValN(TCHoist, "hoist", "Obfuscate them in the preheader"),
+               clEnumValN(TCInline, "inline",
+                          "Obfuscate them at the use, as without loops")));
+
+static cl::opt<bool> EncodeSwitch(
+    "obfcon-switch", cl::init(false),
+    cl::desc("Re-encode switch cases through an opaque bijection that keeps "
+             "them dense"));
+
+static cl::opt<bool> ObfuscateGEP(
+    "obfcon-gep", cl::init(false),
+    cl::desc("Hide the constant offsets of GEPs in loops where they can be "
+             "hoisted to a preheader"));
+
+static cl::opt<bool> CheapOperands(
+    "obfcon-cheap-operands", cl::init(false),
+    cl::desc("Build opaque zeros from values that are ready early and "
+             "already live, instead of any random value"));
+
 namespace {
 class ObfuscateConstant : public FunctionPass {
 private:
   std::vector<Value *> IntegerVect;
   std::unordered_set<Value *> OriginalInst;
-  std::default_random_engine Generator;
+  ObfRNG Generator;
+  // LI is only set with -obfcon-loop-aware
+  LoopInfo *Loops = nullptr;
+  LoopInfo *LI = nullptr;
+  std::map<std::pair<Instruction *, Constant *>, Value *> Hoisted;
+  DenseMap<Value *, unsigned> Depth;
+  BasicBlock *PositionBB = nullptr;
+  DenseMap<Instruction *, unsigned> Position;
+  // Split constants, checked once their zeros are obfuscated
+  std::vector<std::pair<Value *, Constant *>> Splits;
+  // -obfcon-mode=table: entries of the function's table, and the
+  // placeholder its loads refer to until it is emitted
+  GlobalVariable *TableVar = nullptr;
+  uint64_t TableKey = 0;
+  std::vector<uint64_t> TableValues;
+  std::map<uint64_t, uint64_t> TableIndex;
 
 public:
   static char ID;
   ObfuscateConstant() : FunctionPass(ID) {}
   bool runOnFunction(Function &F) override;
+  bool run(Function &F, LoopInfo &LoopInfo);
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<LoopInfoWrapperPass>();
+    // Replaying from the cache rebuilds every block
+    if (!ObfCache::enabled())
+      AU.setPreservesCFG();
+  }
 
 private:
+  bool obfuscate(Function &F);
   bool isValidCandidateInstruction(Instruction &Inst) const;
-  ConstantInt *isSplitCandidateOperand(Value *V) const;
-  ConstantInt *isObfCandidateOperand(Value *V) const;
+  Constant *isSplitCandidateOperand(Value *V) const;
+  Constant *isObfCandidateOperand(Value *V) const;
+  bool encodeSwitch(SwitchInst *SI);
+  bool obfuscateGEP(GetElementPtrInst *GEP, LoopInfo &Loops);
+  bool isTripCountInstruction(Instruction &Inst, Loop *L) const;
+  Instruction *getInsertPoint(Instruction &Inst, Loop *&Boundary) const;
+  bool isAvailableAt(Value *V, Instruction *InsertPt, Loop *Boundary) const;
+  unsigned getDepth(Value *V);
+  bool isLiveAt(Value *V, Instruction *InsertPt);
+  void pickOperands(std::vector<Value *> &Cands, Instruction *InsertPt);
   void registerInteger(Value &V, bool original = false);
-  Value *replaceZero(Instruction &Inst, ConstantInt *VReplace);
-  Value *createExpression(Value *x, const uint32_t p, IRBuilder<> &Builder);
-  Value *splitConst(Instruction &Inst, ConstantInt *VReplace);
+  Value *replaceZero(Instruction &Inst, Constant *VReplace);
+  Value *splitConst(Instruction &Inst, Constant *VReplace);
+  Value *buildSplit(Constant *VReplace, Instruction *InsertPt);
+  Value *loadConst(ConstantInt *VReplace, Instruction *InsertPt);
+  void emitTable(Function &F);
 };
 } // namespace
 
@@ -42,10 +123,59 @@ static RegisterPass<ObfuscateConstant> X("obfCon",
                                          "Split and obfuscate constants");
 Pass *createObfuscateConstantPass() { return new ObfuscateConstant(); }
 
+PreservedAnalyses ObfuscateConstantPass::run(Function &F,
+                                             FunctionAnalysisManager &AM) {
+  if (!ObfuscateConstant().run(F, AM.getResult<LoopAnalysis>(F)))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  // Replaying from the cache rebuilds every block
+  if (!ObfCache::enabled())
+    PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+
+// Everything the output depends on besides the IR and the seed
+static std::string cacheOptions() {
+  return "mode=" + utostr(Mode) + ";loop=" + utostr(LoopAware) +
+         ";trip=" + utostr(TripCount) + ";switch=" + utostr(EncodeSwitch) +
+         ";gep=" + utostr(ObfuscateGEP) + ";cheap=" + utostr(CheapOperands) +
+         ";" + mbaOptions();
+}
+
 bool ObfuscateConstant::runOnFunction(Function &F) {
+  return run(F, getAnalysis<LoopInfoWrapperPass>().getLoopInfo());
+}
+
+bool ObfuscateConstant::run(Function &F, LoopInfo &LoopInfo) {
+  Loops = &LoopInfo;
+  ObfCache Cache("obfCon", F, cacheOptions());
+  if (Cache.replay())
+    return true;
+  bool modified = obfuscate(F);
+  Cache.store();
+  return modified;
+}
+
+bool ObfuscateConstant::obfuscate(Function &F) {
   bool modified = false;
 
+  Generator = createRNG("obfCon", F);
+  LI = LoopAware ? Loops : nullptr;
+  Hoisted.clear();
+  Depth.clear();
+  PositionBB = nullptr;
   OriginalInst.clear();
+  Splits.clear();
+  TableValues.clear();
+  TableIndex.clear();
+  if (Mode == CMTable) {
+    ObfRNG TableGenerator = createRNG("obfCon.table", F);
+    std::uniform_int_distribution<uint64_t> urand64(0, UINT64_MAX);
+    TableKey = urand64(TableGenerator) | 1;
+    TableVar = new GlobalVariable(
+        *F.getParent(), Type::getInt64Ty(F.getContext()), true,
+        GlobalValue::ExternalLinkage, nullptr, "__YANSOLLVM_ConstTable");
+  }
   for (auto &BB : F.getBasicBlockList()) {
     for (BasicBlock::iterator I = BB.getFirstInsertionPt(), end = BB.end();
          I != end; ++I) {
@@ -54,29 +184,56 @@ bool ObfuscateConstant::runOnFunction(Function &F) {
     }
   }
 
-  for (auto &BB : F.getBasicBlockList()) {
+  if (EncodeSwitch) {
+    std::vector<SwitchInst *> SwitchList;
+    for (auto &BB : F.getBasicBlockList())
+      if (SwitchInst *SI = dyn_cast<SwitchInst>(BB.getTerminator()))
+        SwitchList.push_back(SI);
+    for (SwitchInst *SI : SwitchList)
+      modified |= encodeSwitch(SI);
+  }
+
+  if (ObfuscateGEP) {
+    std::vector<GetElementPtrInst *> GEPList;
+    for (auto &BB : F.getBasicBlockList())
+      for (Instruction &I : BB)
+        if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(&I))
+          GEPList.push_back(GEP);
+    for (GetElementPtrInst *GEP : GEPList)
+      modified |= obfuscateGEP(GEP, *Loops);
+  }
+
+  // Split first, so that the zeros of expressions hoisted into an already
+  // visited preheader are still obfuscated below
+  std::vector<Instruction *> SplitList;
+  for (auto &BB : F.getBasicBlockList())
     for (BasicBlock::iterator I = BB.getFirstInsertionPt(), end = BB.end();
-         I != end; ++I) {
-      Instruction &Inst = *I;
-      if (isValidCandidateInstruction(Inst)) {
-        size_t opSize = Inst.getNumOperands();
-        // Do not obfuscate switch cases
-        if (isa<SwitchInst>(&Inst))
-          opSize = 1;
-        for (size_t i = 0; i < opSize; ++i) {
-          if (ConstantInt *C = isSplitCandidateOperand(Inst.getOperand(i))) {
-            if (CallInst *CI = dyn_cast<CallInst>(&Inst))
-              if (CI->paramHasAttr(i, Attribute::ImmArg))
-                break;
-            if (Value *New_val = splitConst(Inst, C)) {
-              Inst.setOperand(i, New_val);
-              modified = true;
-            }
-          }
+         I != end; ++I)
+      if (isValidCandidateInstruction(*I))
+        SplitList.push_back(&*I);
+  for (Instruction *I : SplitList) {
+    Instruction &Inst = *I;
+    size_t opSize = Inst.getNumOperands();
+    // Do not obfuscate switch cases
+    if (isa<SwitchInst>(&Inst))
+      opSize = 1;
+    // Shuffle masks must stay constant
+    if (isa<ShuffleVectorInst>(&Inst))
+      opSize = 2;
+    for (size_t i = 0; i < opSize; ++i) {
+      if (Constant *C = isSplitCandidateOperand(Inst.getOperand(i))) {
+        if (CallInst *CI = dyn_cast<CallInst>(&Inst))
+          if (CI->paramHasAttr(i, Attribute::ImmArg))
+            break;
+        if (Value *New_val = splitConst(Inst, C)) {
+          Inst.setOperand(i, New_val);
+          modified = true;
         }
       }
     }
+  }
 
+  for (auto &BB : F.getBasicBlockList()) {
     IntegerVect.clear();
     BasicBlock *PBB = BB.getSinglePredecessor();
     while (PBB) {
@@ -84,7 +241,7 @@ bool ObfuscateConstant::runOnFunction(Function &F) {
                                 end = PBB->end();
            I != end; ++I) {
         Instruction &Inst = *I;
-        if (std::count(OriginalInst.begin(), OriginalInst.end(), &Inst))
+        if (OriginalInst.count(&Inst))
           registerInteger(Inst);
       }
       PBB = PBB->getSinglePredecessor();
@@ -104,8 +261,11 @@ bool ObfuscateConstant::runOnFunction(Function &F) {
         // Do not obfzero function args
         if (isa<CallInst>(&Inst))
           opSize = 0;
+        // Shuffle masks must stay constant
+        if (isa<ShuffleVectorInst>(&Inst))
+          opSize = 2;
         for (size_t i = 0; i < opSize; ++i) {
-          if (ConstantInt *C = isObfCandidateOperand(Inst.getOperand(i))) {
+          if (Constant *C = isObfCandidateOperand(Inst.getOperand(i))) {
             if (Value *New_val = replaceZero(Inst, C)) {
               Inst.setOperand(i, New_val);
               modified = true;
@@ -113,10 +273,14 @@ bool ObfuscateConstant::runOnFunction(Function &F) {
           }
         }
       }
-      if (std::count(OriginalInst.begin(), OriginalInst.end(), &Inst))
+      if (OriginalInst.count(&Inst))
         registerInteger(Inst);
     }
   }
+
+  verifyConstants(Splits, OriginalInst);
+  if (Mode == CMTable)
+    emitTable(F);
   return modified;
 }
 
@@ -134,82 +298,370 @@ bool ObfuscateConstant::isValidCandidateInstruction(Instruction &Inst) const {
   }
 }
 
-ConstantInt *ObfuscateConstant::isSplitCandidateOperand(Value *V) const {
+// Replace switch (x) by switch (((x + b) ^ k)), with the cases mapped the same
+// way. b moves the cases into an aligned block of 2^m values, the smallest
+// power of two holding their range, and k < 2^m permutes that block. The map
+// is a bijection, so the default destination is unchanged, and the cases span
+// less than twice their original range: a jump table stays a jump table. b and
+// k are then split like any other constant.
+bool ObfuscateConstant::encodeSwitch(SwitchInst *SI) {
+  IntegerType *Ty = cast<IntegerType>(SI->getCondition()->getType());
+  unsigned Bits = Ty->getBitWidth();
+  if (Bits < 8 || Bits > 64 || SI->getNumCases() == 0)
+    return false;
+  uint64_t Mask = bitMask(Bits);
+
+  // Find the range in unsigned or signed order, whichever is tighter
+  uint64_t ULo = Mask, UHi = 0;
+  int64_t SLo = INT64_MAX, SHi = INT64_MIN;
+  for (auto Case : SI->cases()) {
+    const APInt &V = Case.getCaseValue()->getValue();
+    ULo = std::min(ULo, V.getZExtValue());
+    UHi = std::max(UHi, V.getZExtValue());
+    SLo = std::min(SLo, V.getSExtValue());
+    SHi = std::max(SHi, V.getSExtValue());
+  }
+  uint64_t Lo = ULo, Span = UHi - ULo;
+  if ((uint64_t)SHi - (uint64_t)SLo < Span) {
+    Lo = (uint64_t)SLo & Mask;
+    Span = (uint64_t)SHi - (uint64_t)SLo;
+  }
+
+  unsigned Log = 0;
+  while (Log < Bits && (Span >> Log) != 0)
+    Log++;
+  uint64_t Block = bitMask(Log);
+  std::uniform_int_distribution<uint64_t> urand64(0, UINT64_MAX);
+  uint64_t Base = urand64(Generator) & Mask & ~Block;
+  uint64_t Offset = Block == Span ? 0 : urand64(Generator) % (Block - Span + 1);
+  uint64_t b = (Base + Offset - Lo) & Mask;
+  uint64_t k = urand64(Generator) & Block;
+
+  IRBuilder<> Builder(SI);
+  Value *Cond = Builder.CreateAdd(SI->getCondition(), ConstantInt::get(Ty, b));
+  Cond = Builder.CreateXor(Cond, ConstantInt::get(Ty, k));
+  SI->setCondition(Cond);
+  for (auto Case : SI->cases()) {
+    uint64_t V = Case.getCaseValue()->getZExtValue();
+    Case.setValue(ConstantInt::get(Ty, ((V + b) & Mask) ^ k));
+  }
+  return true;
+}
+
+// Rewrite base + idx * scale + disp as (base + opaque disp) + idx * scale.
+// The first part is built as far out as the base allows, so the access keeps
+// a single x86 addressing mode. A GEP is only rewritten if the whole opaque
+// base can be hoisted to a loop preheader: otherwise the access would gain
+// the split and an add for an offset it folded for free, and an inbounds GEP
+// with a variable index would lose its inbounds. GEPs with more than one
+// variable index are left alone.
+bool ObfuscateConstant::obfuscateGEP(GetElementPtrInst *GEP, LoopInfo &Loops) {
+  if (GEP->getType()->isVectorTy())
+    return false;
+  const DataLayout &DL = GEP->getModule()->getDataLayout();
+  Value *Base = GEP->getPointerOperand();
+  unsigned AS = GEP->getPointerAddressSpace();
+  IntegerType *IdxTy =
+      IntegerType::get(GEP->getContext(), DL.getIndexSizeInBits(AS));
+
+  int64_t Offset = 0;
+  Value *Var = nullptr;
+  Type *VarTy = nullptr;
+  for (gep_type_iterator GTI = gep_type_begin(GEP), E = gep_type_end(GEP);
+       GTI != E; ++GTI) {
+    if (StructType *STy = GTI.getStructTypeOrNull()) {
+      unsigned Field = cast<ConstantInt>(GTI.getOperand())->getZExtValue();
+      Offset += DL.getStructLayout(STy)->getElementOffset(Field);
+    } else if (ConstantInt *CI = dyn_cast<ConstantInt>(GTI.getOperand())) {
+      Offset += CI->getSExtValue() * DL.getTypeAllocSize(GTI.getIndexedType());
+    } else {
+      if (Var)
+        return false;
+      Var = GTI.getOperand();
+      VarTy = GTI.getIndexedType();
+    }
+  }
+  if (!Offset)
+    return false;
+
+  Loop *L = Loops.getLoopFor(GEP->getParent());
+  Instruction *BaseI = dyn_cast<Instruction>(Base);
+  Loop *Outer = nullptr;
+  for (; L && !(BaseI && L->contains(BaseI)); L = L->getParentLoop())
+    if (L->getLoopPreheader())
+      Outer = L;
+  if (!Outer)
+    return false;
+  Instruction *InsertPt = Outer->getLoopPreheader()->getTerminator();
+
+  Value *Disp = buildSplit(ConstantInt::get(IdxTy, Offset), InsertPt);
+  IRBuilder<> Builder(InsertPt);
+  Value *NewBase = Builder.CreatePointerCast(
+      Base, Type::getInt8PtrTy(GEP->getContext(), AS));
+  // Only the full offset is known to stay in bounds
+  NewBase = Var || !GEP->isInBounds()
+                ? Builder.CreateGEP(Builder.getInt8Ty(), NewBase, Disp)
+                : Builder.CreateInBoundsGEP(Builder.getInt8Ty(), NewBase, Disp);
+
+  Value *replaced = NewBase;
+  Builder.SetInsertPoint(GEP);
+  if (Var) {
+    replaced = Builder.CreatePointerCast(NewBase, VarTy->getPointerTo(AS));
+    replaced = Builder.CreateGEP(VarTy, replaced, Var);
+  }
+  replaced = Builder.CreatePointerCast(replaced, GEP->getType());
+  replaced->takeName(GEP);
+  GEP->replaceAllUsesWith(replaced);
+  GEP->eraseFromParent();
+  return true;
+}
+
+// An exit compare of L, or the step of one of its header phis
+bool ObfuscateConstant::isTripCountInstruction(Instruction &Inst,
+                                               Loop *L) const {
+  if (ICmpInst *Cmp = dyn_cast<ICmpInst>(&Inst)) {
+    for (User *U : Cmp->users())
+      if (BranchInst *Br = dyn_cast<BranchInst>(U))
+        if (L->isLoopExiting(Br->getParent()))
+          return true;
+    return false;
+  }
+  if (Inst.getOpcode() == Instruction::Add ||
+      Inst.getOpcode() == Instruction::Sub) {
+    for (Value *Op : Inst.operands())
+      if (PHINode *Phi = dyn_cast<PHINode>(Op))
+        if (Phi->getParent() == L->getHeader())
+          return true;
+  }
+  return false;
+}
+
+// Where the obfuscated form of a constant used by Inst is built. Outside of
+// -obfcon-loop-aware it is right before Inst. Otherwise it is the preheader of
+// the outermost loop around Inst (Boundary), or the entry block when no
+// enclosing loop has a preheader. Returns nullptr if the constant should be
+// left alone.
+Instruction *ObfuscateConstant::getInsertPoint(Instruction &Inst,
+                                               Loop *&Boundary) const {
+  Boundary = nullptr;
+  Loop *L = LI ? LI->getLoopFor(Inst.getParent()) : nullptr;
+  if (!L)
+    return &Inst;
+  if (isTripCountInstruction(Inst, L)) {
+    if (TripCount == TCKeep)
+      return nullptr;
+    if (TripCount == TCInline)
+      return &Inst;
+  }
+  for (; L; L = L->getParentLoop())
+    if (L->getLoopPreheader())
+      Boundary = L;
+  if (Boundary)
+    return Boundary->getLoopPreheader()->getTerminator();
+  return Inst.getFunction()->getEntryBlock().getTerminator();
+}
+
+bool ObfuscateConstant::isAvailableAt(Value *V, Instruction *InsertPt,
+                                      Loop *Boundary) const {
+  Instruction *I = dyn_cast<Instruction>(V);
+  if (!I)
+    return true;
+  // Everything in IntegerVect dominates the user. If it is also defined
+  // outside the loop, it dominates the preheader.
+  if (Boundary)
+    return !Boundary->contains(I);
+  // InsertPt is the terminator of the entry block
+  return I->getParent() == InsertPt->getParent();
+}
+
+// Integer vectors whose lanes are all plain integers, split lane by lane
+static bool isIntegerVectorConstant(Value *V) {
+  Constant *C = dyn_cast<Constant>(V);
+  if (!C || !C->getType()->isVectorTy() ||
+      !C->getType()->getVectorElementType()->isIntegerTy() ||
+      C->getType()->getScalarSizeInBits() > 64)
+    return false;
+  for (unsigned i = 0, e = C->getType()->getVectorNumElements(); i < e; i++)
+    if (!isa_and_nonnull<ConstantInt>(C->getAggregateElement(i)))
+      return false;
+  return true;
+}
+
+Constant *ObfuscateConstant::isSplitCandidateOperand(Value *V) const {
   if (ConstantInt *C = dyn_cast<ConstantInt>(V)) {
+    if (C->getBitWidth() > 64)
+      return nullptr;
     uint64_t v = C->getValue().getLimitedValue();
     if (v && v != UINT64_MAX) {
       return C;
     } else {
       return nullptr;
     }
+  } else if (isIntegerVectorConstant(V) && !cast<Constant>(V)->isNullValue()) {
+    return cast<Constant>(V);
   } else {
     return nullptr;
   }
 }
 
-ConstantInt *ObfuscateConstant::isObfCandidateOperand(Value *V) const {
+Constant *ObfuscateConstant::isObfCandidateOperand(Value *V) const {
   if (ConstantInt *C = dyn_cast<ConstantInt>(V)) {
     if (C->isZero()) {
       return C;
     } else {
       return nullptr;
     }
+  } else if (isIntegerVectorConstant(V) && cast<Constant>(V)->isNullValue()) {
+    return cast<Constant>(V);
   } else {
     return nullptr;
   }
 }
 
-Value *ObfuscateConstant::splitConst(Instruction &Inst, ConstantInt *VReplace) {
-  IntegerType *ReplacedType = VReplace->getType(),
-              *i64 = IntegerType::get(Inst.getParent()->getContext(),
-                                      sizeof(uint64_t) * 8);
+// Hide a constant at the outermost point where it can be built, see
+// getInsertPoint.
+Value *ObfuscateConstant::splitConst(Instruction &Inst, Constant *VReplace) {
+  Loop *Boundary;
+  Instruction *InsertPt = getInsertPoint(Inst, Boundary);
+  if (!InsertPt)
+    return nullptr;
+  if (InsertPt != &Inst) {
+    auto It = Hoisted.find(std::make_pair(InsertPt, VReplace));
+    if (It != Hoisted.end())
+      return It->second;
+  }
+
+  Value *replaced = nullptr;
+  if (Mode == CMTable && isa<ConstantInt>(VReplace))
+    replaced = loadConst(cast<ConstantInt>(VReplace), InsertPt);
+  else
+    replaced = buildSplit(VReplace, InsertPt);
+  if (InsertPt != &Inst)
+    Hoisted[std::make_pair(InsertPt, VReplace)] = replaced;
+
+  return replaced;
+}
+
+// Split the constant into two halves combined with mul, xor or add. Both
+// halves are computed at the constant's own width, so i8/i16/i32 constants do
+// not pay for 64-bit multiplies and the extend/truncate around them. Vector
+// constants are split lane-wise with the same operation in every lane, so
+// the expression stays in vector registers.
+Value *ObfuscateConstant::buildSplit(Constant *VReplace,
+                                     Instruction *InsertPt) {
+  Type *ReplacedType = VReplace->getType();
+  IntegerType *ElemType = cast<IntegerType>(ReplacedType->getScalarType());
+  unsigned Bits = ElemType->getBitWidth();
+  uint64_t Mask = bitMask(Bits);
+  unsigned Lanes =
+      ReplacedType->isVectorTy() ? ReplacedType->getVectorNumElements() : 1;
 
   std::uniform_int_distribution<uint64_t> urand64(0, (UINT64_MAX >> 1) - 1);
-  IRBuilder<> Builder(&Inst);
-  Value *replaced = Builder.CreateIntCast(VReplace, i64, true);
-  uint64_t v = VReplace->getValue().getLimitedValue();
-  switch (urand64(Generator) % 3) {
-  case 0: {
-    uint64_t randv = urand64(Generator) * 2 + 1;
-    BinaryOperator *rv1 = BinaryOperator::Create(
-        (urand64(Generator) % 2 ? BinaryOperator::Add : BinaryOperator::Xor),
-        ConstantInt::get(i64, randv), ConstantInt::get(i64, 0), "", &Inst);
-    BinaryOperator *rv2 = BinaryOperator::Create(
-        (urand64(Generator) % 2 ? BinaryOperator::Add : BinaryOperator::Xor),
-        ConstantInt::get(i64, modinv(randv) * v), ConstantInt::get(i64, 0), "",
-        &Inst);
-    replaced = Builder.CreateMul(rv1, rv2);
-    break;
+  std::vector<Constant *> randv, rest;
+  unsigned Kind = urand64(Generator) % 3;
+  for (unsigned l = 0; l < Lanes; l++) {
+    Constant *Lane = ReplacedType->isVectorTy()
+                         ? VReplace->getAggregateElement(l)
+                         : VReplace;
+    uint64_t v = cast<ConstantInt>(Lane)->getValue().getLimitedValue();
+    uint64_t r, s;
+    switch (Kind) {
+    case 0:
+      r = (urand64(Generator) * 2 + 1) & Mask;
+      s = (modinv(r, Bits) * v) & Mask;
+      assert(((r * s) & Mask) == v && "Bad mul split");
+      break;
+    case 1:
+      r = urand64(Generator) & Mask;
+      s = r ^ v;
+      assert(((r ^ s) & Mask) == v && "Bad xor split");
+      break;
+    default:
+      r = urand64(Generator) & Mask;
+      s = (v - r) & Mask;
+      assert(((r + s) & Mask) == v && "Bad add split");
+    }
+    randv.push_back(ConstantInt::get(ElemType, r));
+    rest.push_back(ConstantInt::get(ElemType, s));
   }
-  case 1: {
-    uint64_t randv = urand64(Generator);
-    BinaryOperator *rv1 = BinaryOperator::Create(
-        (urand64(Generator) % 2 ? BinaryOperator::Add : BinaryOperator::Xor),
-        ConstantInt::get(i64, randv), ConstantInt::get(i64, 0), "", &Inst);
-    BinaryOperator *rv2 = BinaryOperator::Create(
-        (urand64(Generator) % 2 ? BinaryOperator::Add : BinaryOperator::Xor),
-        ConstantInt::get(i64, randv ^ v), ConstantInt::get(i64, 0), "", &Inst);
-    replaced = Builder.CreateXor(rv1, rv2);
+
+  IRBuilder<> Builder(InsertPt);
+  Constant *Zero = Constant::getNullValue(ReplacedType);
+  BinaryOperator *rv1 = BinaryOperator::Create(
+      (urand64(Generator) % 2 ? BinaryOperator::Add : BinaryOperator::Xor),
+      ReplacedType->isVectorTy() ? ConstantVector::get(randv) : randv[0],
+      Zero, "", InsertPt);
+  BinaryOperator *rv2 = BinaryOperator::Create(
+      (urand64(Generator) % 2 ? BinaryOperator::Add : BinaryOperator::Xor),
+      ReplacedType->isVectorTy() ? ConstantVector::get(rest) : rest[0],
+      Zero, "", InsertPt);
+  Value *Split;
+  switch (Kind) {
+  case 0:
+    Split = Builder.CreateMul(rv1, rv2);
     break;
+  case 1:
+    Split = Builder.CreateXor(rv1, rv2);
+    break;
+  default:
+    Split = Builder.CreateAdd(rv1, rv2);
   }
-  default: {
-    uint64_t randv = urand64(Generator);
-    BinaryOperator *rv1 = BinaryOperator::Create(
-        (urand64(Generator) % 2 ? BinaryOperator::Add : BinaryOperator::Xor),
-        ConstantInt::get(i64, randv), ConstantInt::get(i64, 0), "", &Inst);
-    BinaryOperator *rv2 = BinaryOperator::Create(
-        (urand64(Generator) % 2 ? BinaryOperator::Add : BinaryOperator::Xor),
-        ConstantInt::get(i64, v - randv), ConstantInt::get(i64, 0), "", &Inst);
-    replaced = Builder.CreateAdd(rv1, rv2);
-  }
+  Splits.push_back(std::make_pair(Split, VReplace));
+  return Split;
+}
+
+// Replace the constant by a load from the function's constant table. Entries
+// are 64 bits wide, so eight of them share a cache line, and each value is
+// stored once per function. Entry i is stored xored with Key * (i + 1) and
+// decoded after the load. Both the index and the decode key are split like
+// any other constant, so no immediate next to the load decodes the entry.
+Value *ObfuscateConstant::loadConst(ConstantInt *VReplace,
+                                    Instruction *InsertPt) {
+  IntegerType *i64 = Type::getInt64Ty(InsertPt->getContext());
+  uint64_t v = VReplace->getValue().getLimitedValue();
+  uint64_t Index;
+  auto It = TableIndex.find(v);
+  if (It == TableIndex.end()) {
+    Index = TableValues.size();
+    TableValues.push_back(v);
+    TableIndex[v] = Index;
+  } else {
+    Index = It->second;
   }
-  replaced = Builder.CreateIntCast(replaced, ReplacedType, true);
 
-  return replaced;
+  Value *Idx = buildSplit(ConstantInt::get(i64, Index), InsertPt);
+  IRBuilder<> Builder(InsertPt);
+  Value *Entry = Builder.CreateGEP(i64, TableVar, Idx);
+  Value *Key = buildSplit(ConstantInt::get(i64, TableKey * (Index + 1)),
+                          InsertPt);
+  Value *replaced = Builder.CreateXor(Builder.CreateLoad(i64, Entry), Key);
+  return Builder.CreateTrunc(replaced, VReplace->getType());
+}
+
+// Emit the scrambled table of F in place of its placeholder. It is constant,
+// so it needs no constructor, and private to F, so the cache and
+// -obf-parallel carry it along with the function.
+void ObfuscateConstant::emitTable(Function &F) {
+  if (!TableValues.empty()) {
+    std::vector<uint64_t> Scrambled;
+    for (size_t i = 0; i < TableValues.size(); i++)
+      Scrambled.push_back(TableValues[i] ^ (TableKey * (i + 1)));
+    Constant *Init = ConstantDataArray::get(F.getContext(), Scrambled);
+    GlobalVariable *Table =
+        new GlobalVariable(*F.getParent(), Init->getType(), true,
+                           GlobalValue::PrivateLinkage, Init, "");
+    Table->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    Table->setAlignment(64);
+    TableVar->replaceAllUsesWith(
+        ConstantExpr::getBitCast(Table, TableVar->getType()));
+    Table->takeName(TableVar);
+  }
+  TableVar->eraseFromParent();
+  TableVar = nullptr;
 }
 
 void ObfuscateConstant::registerInteger(Value &V, bool original) {
-  if (V.getType()->isIntegerTy() && !dyn_cast<llvm::ConstantInt>(&V)) {
+  if (V.getType()->isIntOrIntVectorTy() && !isa<Constant>(&V)) {
     if (original)
       OriginalInst.insert(&V);
     else
@@ -217,102 +669,162 @@ void ObfuscateConstant::registerInteger(Value &V, bool original) {
   }
 }
 
-Value *ObfuscateConstant::createExpression(Value *x, const uint32_t p,
-                                           IRBuilder<> &Builder) {
-  Type *IntermediaryType = x->getType();
-  std::uniform_int_distribution<size_t> RandAny(1, 255);
-  Constant *any = ConstantInt::get(IntermediaryType, RandAny(Generator)),
-           *prime = ConstantInt::get(IntermediaryType, p),
-           *OverflowMask = ConstantInt::get(IntermediaryType, 0xFF);
-
-  Value *temp = Builder.CreateOr(x, any);
-  temp = Builder.CreateAnd(OverflowMask, temp);
-  temp = Builder.CreateMul(temp, temp);
-  temp = Builder.CreateMul(prime, temp);
-  registerInteger(*temp);
-
-  return temp;
+// Cycles until V is ready, counted from the start of its block. Values from
+// other blocks are ready on entry.
+unsigned ObfuscateConstant::getDepth(Value *V) {
+  Instruction *I = dyn_cast<Instruction>(V);
+  if (!I || isa<PHINode>(I))
+    return 0;
+  auto It = Depth.find(I);
+  if (It != Depth.end())
+    return It->second;
+
+  unsigned Latency = 1;
+  switch (I->getOpcode()) {
+  case Instruction::Load:
+    Latency = 5;
+    break;
+  case Instruction::Mul:
+    Latency = 3;
+    break;
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+    Latency = 25;
+    break;
+  case Instruction::Call:
+  case Instruction::Invoke:
+    Latency = 10;
+    break;
+  default:
+    break;
+  }
+  unsigned Ready = 0;
+  for (Value *Op : I->operands())
+    if (Instruction *OpI = dyn_cast<Instruction>(Op))
+      if (OpI->getParent() == I->getParent())
+        Ready = std::max(Ready, getDepth(OpI));
+  return Depth[I] = Ready + Latency;
+}
+
+// Whether V has to stay in a register past InsertPt anyway. Uses in other
+// blocks count as live; uses we inserted ourselves do not.
+bool ObfuscateConstant::isLiveAt(Value *V, Instruction *InsertPt) {
+  BasicBlock *BB = InsertPt->getParent();
+  if (PositionBB != BB) {
+    PositionBB = BB;
+    Position.clear();
+    unsigned Pos = 0;
+    for (Instruction &I : *BB)
+      Position[&I] = Pos++;
+  }
+  auto Here = Position.find(InsertPt);
+  for (User *U : V->users()) {
+    Instruction *UI = dyn_cast<Instruction>(U);
+    if (!UI)
+      continue;
+    if (UI->getParent() != BB)
+      return true;
+    auto There = Position.find(UI);
+    if (There != Position.end() && Here != Position.end() &&
+        There->second >= Here->second)
+      return true;
+  }
+  return false;
+}
+
+// Keep the cheapest quarter of Cands (at least two): operands that are ready
+// early do not delay the opaque zero behind a long dependency chain, and
+// operands that are live anyway do not add register pressure.
+void ObfuscateConstant::pickOperands(std::vector<Value *> &Cands,
+                                     Instruction *InsertPt) {
+  if (Cands.size() <= 2)
+    return;
+  const unsigned DeadPenalty = 3;
+  unsigned InsertDepth = getDepth(InsertPt);
+  std::vector<std::pair<unsigned, Value *>> Ranked;
+  for (Value *V : Cands) {
+    unsigned Cost = getDepth(V);
+    // Already computed by the time the user issues
+    Cost = Cost > InsertDepth ? Cost - InsertDepth : 0;
+    if (!isLiveAt(V, InsertPt))
+      Cost += DeadPenalty;
+    Ranked.push_back(std::make_pair(Cost, V));
+  }
+  std::stable_sort(Ranked.begin(), Ranked.end(),
+                   [](const std::pair<unsigned, Value *> &a,
+                      const std::pair<unsigned, Value *> &b) {
+                     return a.first < b.first;
+                   });
+  size_t Keep = std::max<size_t>(2, Ranked.size() / 4);
+  Cands.clear();
+  for (size_t i = 0; i < Keep; i++)
+    Cands.push_back(Ranked[i].second);
 }
 
-Value *ObfuscateConstant::replaceZero(Instruction &Inst,
-                                      ConstantInt *VReplace) {
-  IntegerType *ReplacedType = VReplace->getType(),
-              *i32 = IntegerType::get(Inst.getParent()->getContext(),
+// Scalar zeros are built in i32 from one or two live integers. Integer vector
+// zeros are built lane-wise from vectors of the same type, or from splats of
+// scalars. The identity comes from the MBA library, under the hot budget if
+// the zero lands in a loop.
+Value *ObfuscateConstant::replaceZero(Instruction &Inst, Constant *VReplace) {
+  Type *ReplacedType = VReplace->getType();
+  IntegerType *i32 = IntegerType::get(Inst.getParent()->getContext(),
                                       sizeof(uint32_t) * 8);
+  VectorType *VT = dyn_cast<VectorType>(ReplacedType);
 
   Value *replaced = nullptr;
 
-  if (IntegerVect.size() > 0) {
-    IRBuilder<> Builder(&Inst);
-    std::uniform_int_distribution<size_t> Rand(0, IntegerVect.size() - 1);
-    std::uniform_int_distribution<uint32_t> randswitch(0, 2);
+  Loop *Boundary;
+  Instruction *InsertPt = getInsertPoint(Inst, Boundary);
+  if (!InsertPt)
+    return nullptr;
+  std::vector<Value *> Cands;
+  if (InsertPt != &Inst) {
+    auto It = Hoisted.find(std::make_pair(InsertPt, VReplace));
+    if (It != Hoisted.end())
+      return It->second;
+    for (Value *V : IntegerVect)
+      if (isAvailableAt(V, InsertPt, Boundary))
+        Cands.push_back(V);
+  } else {
+    Cands = IntegerVect;
+  }
+  Cands.erase(std::remove_if(Cands.begin(), Cands.end(),
+                             [&](Value *V) {
+                               return !V->getType()->isIntegerTy() &&
+                                      V->getType() != ReplacedType;
+                             }),
+              Cands.end());
+  if (CheapOperands)
+    pickOperands(Cands, InsertPt);
+
+  if (Cands.size() > 0) {
+    IRBuilder<> Builder(InsertPt);
+    auto Operand = [&](Value *V) -> Value * {
+      if (!VT)
+        return Builder.CreateIntCast(V, i32, false);
+      if (V->getType() == VT)
+        return V;
+      V = Builder.CreateIntCast(V, VT->getElementType(), false);
+      return Builder.CreateVectorSplat(VT->getNumElements(), V);
+    };
+    std::uniform_int_distribution<size_t> Rand(0, Cands.size() - 1);
     size_t ix = Rand(Generator);
-    Value *temp = IntegerVect[ix];
-    Value *x = Builder.CreateIntCast(temp, i32, false);
-    if (IntegerVect.size() == 1) {
-      // ((~x | 0x7AFAFA69) & 0xA061440) + ((x & 0x1050504) | 0x1010104) ==
-      // 185013572
-      temp = Builder.CreateNot(x);
-      temp = Builder.CreateOr(temp, ConstantInt::get(i32, 0x7AFAFA69));
-      temp = Builder.CreateAnd(temp, ConstantInt::get(i32, 0xA061440));
-      replaced = Builder.CreateAnd(x, ConstantInt::get(i32, 0x1050504));
-      replaced = Builder.CreateOr(replaced, ConstantInt::get(i32, 0x1010104));
-      replaced = Builder.CreateAdd(replaced, temp);
-      replaced = Builder.CreateXor(replaced, ConstantInt::get(i32, 185013572));
-      replaced = Builder.CreateIntCast(replaced, ReplacedType, false);
-    } else {
+    Value *x = Operand(Cands[ix]);
+    Value *y = nullptr;
+    if (Cands.size() > 1) {
       size_t iy = Rand(Generator);
       while (ix == iy)
         iy = Rand(Generator);
-      temp = IntegerVect[iy];
-      Value *y = Builder.CreateIntCast(temp, i32, false);
-
-      switch (randswitch(Generator)) {
-      case 0: {
-        // p1*(x|any)**2 != p2*(y|any)**2
-        uint32_t randp1 = randPrime(1 << 8, 1 << 16);
-        uint32_t randp2 = randPrime(1 << 8, 1 << 16);
-        while (randp1 == randp2)
-          randp2 = randPrime(1 << 8, 1 << 16);
-        Value *LhsTot = createExpression(x, randp1, Builder);
-        Value *RhsTot = createExpression(y, randp2, Builder);
-        Value *comp = Builder.CreateICmp(CmpInst::ICMP_EQ, LhsTot, RhsTot);
-        replaced = Builder.CreateSExt(comp, ReplacedType);
-        break;
-      }
-      case 1: {
-        // x + y = x^y + 2*(x&y)
-        replaced = Builder.CreateAdd(x, y);
-        temp = Builder.CreateXor(x, y);
-        replaced = Builder.CreateSub(replaced, temp);
-        temp = Builder.CreateAnd(x, y);
-        temp = Builder.CreateShl(temp, ConstantInt::get(i32, 1));
-        replaced = Builder.CreateXor(replaced, temp);
-        replaced = Builder.CreateIntCast(replaced, ReplacedType, false);
-        break;
-      }
-      case 2: {
-        // x ^ y == (x|~y) - 3*(~(x|y)) + 2*(~x) - y
-        Value *a = Builder.CreateNot(y);
-        a = Builder.CreateOr(x, a);
-        Value *b = Builder.CreateOr(x, y);
-        b = Builder.CreateNot(b);
-        b = Builder.CreateMul(b, ConstantInt::get(i32, -3));
-        Value *c = Builder.CreateNot(x);
-        c = Builder.CreateMul(c, ConstantInt::get(i32, 2));
-        c = Builder.CreateSub(c, y);
-        replaced = Builder.CreateXor(x, y);
-        replaced = Builder.CreateSub(replaced, a);
-        replaced = Builder.CreateSub(replaced, b);
-        replaced = Builder.CreateXor(replaced, c);
-        replaced = Builder.CreateIntCast(replaced, ReplacedType, false);
-        break;
-      }
-      default:
-        errs() << "Impossible\n";
-      }
+      y = Operand(Cands[iy]);
     }
+    bool Hot = Loops->getLoopFor(InsertPt->getParent());
+    replaced = buildMBA(MBAZero, x, y, Builder, mbaBudget(Hot), Generator);
+    replaced = Builder.CreateIntCast(replaced, ReplacedType, false);
     registerInteger(*replaced);
+    if (InsertPt != &Inst)
+      Hoisted[std::make_pair(InsertPt, VReplace)] = replaced;
   }
 
   return replaced;
@@ -0,0 +1,158 @@
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Cache.h"
+#include "Passes.h"
+
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string> ParallelPasses(
+    "obf-parallel-passes", cl::init("flattening,connect,obfCon"),
+    cl::desc("Function passes run by -obf-parallel, in order (any of "
+             "bb2func, connect, flattening and obfCon)"));
+
+static cl::opt<unsigned>
+    Threads("obf-threads", cl::init(0),
+            cl::desc("Threads of -obf-parallel, 0 for one per core"));
+
+// LLVMContext is not thread safe, so every function is obfuscated in a
+// context of its own: it is copied out alone in bitcode, run through the
+// passes on a worker, and its result is put back in function order. Passes
+// draw randomness per function, so the output does not depend on threads.
+// This stands in for locking constant and type creation in one context: the
+// bitcode round trip costs about an eighth of the passes' time on a worker,
+// and merging back another quarter, serially.
+namespace {
+struct Parallel : public ModulePass {
+  static char ID;
+  Parallel() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override;
+};
+} // namespace
+
+char Parallel::ID = 0;
+static RegisterPass<Parallel>
+    X("obf-parallel", "Run function obfuscation passes on a thread pool");
+
+PreservedAnalyses ParallelPass::run(Module &M, ModuleAnalysisManager &AM) {
+  if (!Parallel().runOnModule(M))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
+static Pass *createObfPass(StringRef Name) {
+  if (Name == "bb2func")
+    return createBB2FuncPass();
+  if (Name == "connect")
+    return createConnectPass();
+  if (Name == "flattening")
+    return createFlatteningPass();
+  if (Name == "obfCon")
+    return createObfuscateConstantPass();
+  report_fatal_error("obf-parallel: unknown pass " + Name);
+}
+
+// Runs on a worker; Code is replaced by the obfuscated module
+static void obfuscate(SmallVectorImpl<char> &Code,
+                      ArrayRef<StringRef> PassNames) {
+  LLVMContext Context;
+  Expected<std::unique_ptr<Module>> Part = parseBitcodeFile(
+      MemoryBufferRef(StringRef(Code.data(), Code.size()), "obf-parallel"),
+      Context);
+  if (!Part)
+    report_fatal_error(Part.takeError());
+
+  legacy::FunctionPassManager FPM(Part->get());
+  for (StringRef Name : PassNames)
+    FPM.add(createObfPass(Name));
+  FPM.doInitialization();
+  // Includes functions added by the passes, as when run on the whole module
+  for (Function &F : **Part)
+    if (!F.isDeclaration())
+      FPM.run(F);
+  FPM.doFinalization();
+
+  Code.clear();
+  raw_svector_ostream OS(Code);
+  WriteBitcodeToFile(**Part, OS);
+}
+
+bool Parallel::runOnModule(Module &M) {
+  SmallVector<StringRef, 4> PassNames;
+  StringRef(ParallelPasses).split(PassNames, ',', -1, false);
+  // Fail on unknown names before doing anything
+  for (StringRef Name : PassNames)
+    delete createObfPass(Name);
+
+  std::vector<Function *> Functions, Serial;
+  SmallPtrSet<Function *, 32> Existing;
+  for (Function &F : M) {
+    Existing.insert(&F);
+    if (!F.isDeclaration())
+      (isExtractable(F) ? Functions : Serial).push_back(&F);
+  }
+
+  // Functions that cannot be merged back by name, such as unnamed ones whose
+  // randomness is keyed by their position in M, are obfuscated in place
+  bool modified = false;
+  if (!Serial.empty()) {
+    legacy::FunctionPassManager FPM(&M);
+    for (StringRef Name : PassNames)
+      FPM.add(createObfPass(Name));
+    FPM.doInitialization();
+    for (Function *F : Serial)
+      modified |= FPM.run(*F);
+    // Includes functions added by the passes, as when run on the whole module
+    for (Function &F : M)
+      if (!F.isDeclaration() && !Existing.count(&F))
+        modified |= FPM.run(F);
+    modified |= FPM.doFinalization();
+  }
+
+  std::vector<SmallVector<char, 0>> Codes(Functions.size());
+  for (size_t i = 0; i < Functions.size(); i++) {
+    raw_svector_ostream OS(Codes[i]);
+    WriteBitcodeToFile(*extractFunction(*Functions[i]), OS);
+  }
+
+  {
+    // One task per function on a single FIFO queue, not work stealing: a
+    // worker takes the next function when it is done with its own
+    ThreadPool Pool(Threads ? Threads : heavyweight_hardware_concurrency());
+    for (SmallVector<char, 0> &Code : Codes)
+      Pool.async([&Code, &PassNames] { obfuscate(Code, PassNames); });
+    Pool.wait();
+  }
+
+  for (size_t i = 0; i < Functions.size(); i++) {
+    Expected<std::unique_ptr<Module>> Part = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Codes[i].data(), Codes[i].size()),
+                        "obf-parallel"),
+        M.getContext());
+    if (!Part)
+      report_fatal_error(Part.takeError());
+    if (!replaceFunction(*Functions[i], **Part))
+      report_fatal_error("obf-parallel: cannot merge back " +
+                         Functions[i]->getName() +
+                         ", run these passes without -obf-parallel");
+    modified = true;
+  }
+  return modified;
+}
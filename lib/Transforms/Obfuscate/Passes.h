@@ -0,0 +1,64 @@
+#ifndef LLVM_TRANSFORMS_OBFUSCATE_PASSES_H
+#define LLVM_TRANSFORMS_OBFUSCATE_PASSES_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
+
+// Function passes, also run by -obf-parallel
+llvm::Pass *createBB2FuncPass();
+llvm::Pass *createConnectPass();
+llvm::Pass *createFlatteningPass();
+llvm::Pass *createObfuscateConstantPass();
+
+// New pass manager versions, registered by Plugin.cpp under the names given
+
+// bb2func
+struct BB2FuncPass : llvm::PassInfoMixin<BB2FuncPass> {
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &AM);
+};
+
+// connect
+struct ConnectPass : llvm::PassInfoMixin<ConnectPass> {
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &AM);
+};
+
+// flattening
+struct FlatteningPass : llvm::PassInfoMixin<FlatteningPass> {
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &AM);
+};
+
+// obf-con
+struct ObfuscateConstantPass : llvm::PassInfoMixin<ObfuscateConstantPass> {
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &AM);
+};
+
+// func2mod
+struct Func2ModPass : llvm::PassInfoMixin<Func2ModPass> {
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+};
+
+// merge
+struct MergePass : llvm::PassInfoMixin<MergePass> {
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+};
+
+// obf-call
+struct ObfCallPass : llvm::PassInfoMixin<ObfCallPass> {
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+};
+
+// obf-parallel
+struct ParallelPass : llvm::PassInfoMixin<ParallelPass> {
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+};
+
+// vm
+struct VMPass : llvm::PassInfoMixin<VMPass> {
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+};
+
+#endif
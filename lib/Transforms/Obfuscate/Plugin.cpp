@@ -0,0 +1,50 @@
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+#include "Passes.h"
+
+using namespace llvm;
+
+// Makes the passes available to the new pass manager, e.g.
+//   opt -load-pass-plugin=LLVMObf.so
+//       -passes='vm,merge,function(flattening,connect,obf-con)'
+static bool parseModulePass(StringRef Name, ModulePassManager &MPM,
+                            ArrayRef<PassBuilder::PipelineElement>) {
+  if (Name == "func2mod")
+    MPM.addPass(Func2ModPass());
+  else if (Name == "merge")
+    MPM.addPass(MergePass());
+  else if (Name == "obf-call")
+    MPM.addPass(ObfCallPass());
+  else if (Name == "obf-parallel")
+    MPM.addPass(ParallelPass());
+  else if (Name == "vm")
+    MPM.addPass(VMPass());
+  else
+    return false;
+  return true;
+}
+
+static bool parseFunctionPass(StringRef Name, FunctionPassManager &FPM,
+                              ArrayRef<PassBuilder::PipelineElement>) {
+  if (Name == "bb2func")
+    FPM.addPass(BB2FuncPass());
+  else if (Name == "connect")
+    FPM.addPass(ConnectPass());
+  else if (Name == "flattening")
+    FPM.addPass(FlatteningPass());
+  else if (Name == "obf-con")
+    FPM.addPass(ObfuscateConstantPass());
+  else
+    return false;
+  return true;
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "Obfuscate", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(parseModulePass);
+            PB.registerPipelineParsingCallback(parseFunctionPass);
+          }};
+}
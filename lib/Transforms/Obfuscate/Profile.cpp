@@ -0,0 +1,180 @@
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/ProfileData/SampleProf.h"
+#include "llvm/ProfileData/SampleProfReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "Profile.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string>
+    ProfilePath("obf-profile", cl::init(""),
+                cl::desc("Instrumented (.profdata) or sampled (AutoFDO) "
+                         "profile, by which Flattening and Connect leave "
+                         "the hottest code alone"));
+static cl::opt<double> OverheadBudget(
+    "obf-overhead-budget", cl::init(10),
+    cl::desc("Percent of the profiled run time that Flattening and Connect "
+             "may obfuscate, coldest code first"));
+
+namespace {
+// Run time of the functions of a profile, as the sum of their counters or
+// samples, and what of it may be obfuscated. Functions missing from the
+// profile never ran, and are obfuscated entirely.
+class ObfProfile {
+public:
+  bool load(StringRef Path);
+  // Allowance and run time of F
+  std::pair<uint64_t, uint64_t> lookup(const Function &F) const;
+
+private:
+  StringMap<uint64_t> Heat, Allowance;
+
+  bool loadInstr(StringRef Path);
+  bool loadSample(StringRef Path);
+  void distribute();
+};
+} // namespace
+
+bool ObfProfile::load(StringRef Path) {
+  auto BufferOrErr = MemoryBuffer::getFile(Path);
+  if (!BufferOrErr)
+    return false;
+  bool Loaded = IndexedInstrProfReader::hasFormat(**BufferOrErr)
+                    ? loadInstr(Path)
+                    : loadSample(Path);
+  if (Loaded)
+    distribute();
+  return Loaded;
+}
+
+bool ObfProfile::loadInstr(StringRef Path) {
+  auto ReaderOrErr = IndexedInstrProfReader::create(Path);
+  if (!ReaderOrErr) {
+    consumeError(ReaderOrErr.takeError());
+    return false;
+  }
+  std::unique_ptr<IndexedInstrProfReader> Reader = std::move(*ReaderOrErr);
+  for (const NamedInstrProfRecord &Record : *Reader) {
+    uint64_t &H = Heat[Record.Name];
+    for (uint64_t Count : Record.Counts)
+      H += Count;
+  }
+  return !Reader->hasError();
+}
+
+bool ObfProfile::loadSample(StringRef Path) {
+  LLVMContext Ctx;
+  auto ReaderOrErr = SampleProfileReader::create(Path.str(), Ctx);
+  if (!ReaderOrErr)
+    return false;
+  std::unique_ptr<SampleProfileReader> Reader = std::move(*ReaderOrErr);
+  if (Reader->read())
+    return false;
+  for (auto &I : Reader->getProfiles())
+    Heat[I.second.getName()] += I.second.getTotalSamples();
+  return true;
+}
+
+// Coldest functions first, while their run time fits in the budget. The
+// first one that does not fit gets what is left, to spend on its coldest
+// blocks.
+void ObfProfile::distribute() {
+  std::vector<std::pair<uint64_t, StringRef>> ByHeat;
+  double Total = 0;
+  for (auto &I : Heat) {
+    ByHeat.push_back(std::make_pair(I.second, I.first()));
+    Total += I.second;
+  }
+  std::sort(ByHeat.begin(), ByHeat.end());
+  double Left = Total * OverheadBudget / 100;
+  for (auto &I : ByHeat) {
+    uint64_t A = std::min(Left, double(I.first));
+    Allowance[I.second] = A;
+    Left -= A;
+  }
+}
+
+std::pair<uint64_t, uint64_t> ObfProfile::lookup(const Function &F) const {
+  // As named by instrumentation, by AutoFDO, or as is
+  std::string Names[] = {getPGOFuncName(F),
+                         FunctionSamples::getCanonicalFnName(F).str(),
+                         F.getName().str()};
+  for (const std::string &Name : Names) {
+    auto I = Heat.find(Name);
+    if (I != Heat.end())
+      return std::make_pair(Allowance.lookup(Name), I->second);
+  }
+  return std::make_pair(0, 0);
+}
+
+// Loaded on first use, once per process
+static const ObfProfile *getProfile() {
+  static std::unique_ptr<ObfProfile> Profile = []() {
+    std::unique_ptr<ObfProfile> Profile;
+    if (ProfilePath.empty())
+      return Profile;
+    Profile.reset(new ObfProfile());
+    if (!Profile->load(ProfilePath))
+      report_fatal_error(Twine("Cannot load profile ") + ProfilePath);
+    return Profile;
+  }();
+  return Profile.get();
+}
+
+bool profileEnabled() { return !ProfilePath.empty(); }
+
+// The run time of a block is estimated from its frequency, which follows
+// the branch weights of the IR if any, and its size
+SmallPtrSet<BasicBlock *, 16> hotBlocks(Function &F,
+                                        const BlockFrequencyInfo *BFI) {
+  SmallPtrSet<BasicBlock *, 16> Hot;
+  const ObfProfile *Profile = getProfile();
+  if (!Profile)
+    return Hot;
+  uint64_t Allowance, Heat;
+  std::tie(Allowance, Heat) = Profile->lookup(F);
+  if (Allowance >= Heat)
+    return Hot;
+
+  assert(BFI && "hotBlocks needs block frequencies with a profile");
+  std::vector<std::pair<double, BasicBlock *>> ByCost;
+  double Total = 0;
+  for (BasicBlock &BB : F) {
+    double Cost = double(BFI->getBlockFreq(&BB).getFrequency()) * BB.size();
+    ByCost.push_back(std::make_pair(Cost, &BB));
+    Total += Cost;
+  }
+  std::stable_sort(ByCost.begin(), ByCost.end(),
+                   [](const std::pair<double, BasicBlock *> &A,
+                      const std::pair<double, BasicBlock *> &B) {
+                     return A.first < B.first;
+                   });
+  double Left = Total * Allowance / Heat;
+  for (auto &I : ByCost) {
+    if (I.first > Left)
+      Hot.insert(I.second);
+    else
+      Left -= I.first;
+  }
+  return Hot;
+}
+
+std::string profileOptions(Function &F) {
+  const ObfProfile *Profile = getProfile();
+  if (!Profile)
+    return "";
+  uint64_t Allowance, Heat;
+  std::tie(Allowance, Heat) = Profile->lookup(F);
+  return "profile=" + utostr(Allowance) + "/" + utostr(Heat);
+}
@@ -0,0 +1,20 @@
+#ifndef LLVM_TRANSFORMS_OBFUSCATE_PROFILE_H
+#define LLVM_TRANSFORMS_OBFUSCATE_PROFILE_H
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/Function.h"
+
+#include <string>
+
+// Whether -obf-profile is given, and hotBlocks needs block frequencies
+bool profileEnabled();
+// Blocks of F that Flattening and Connect leave alone, so that the code they
+// obfuscate takes at most -obf-overhead-budget percent of the run time in
+// -obf-profile. Empty without a profile, all of F if none of it fits.
+llvm::SmallPtrSet<llvm::BasicBlock *, 16>
+hotBlocks(llvm::Function &F, const llvm::BlockFrequencyInfo *BFI);
+// What of the profile decides hotBlocks(F), for the cache key
+std::string profileOptions(llvm::Function &F);
+
+#endif
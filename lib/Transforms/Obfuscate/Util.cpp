@@ -1,13 +1,100 @@
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Transforms/Utils/Local.h"
 
 #include "Util.h"
 
+#include <algorithm>
+#include <map>
+#include <mutex>
 #include <random>
 #include <string>
+#include <vector>
 
 using namespace llvm;
+
+static cl::opt<unsigned long long>
+    Seed("obf-seed", cl::init(0),
+         cl::desc("Seed of all obfuscation passes, random if 0"));
+
+uint64_t obfSeed() { return Seed; }
+
+// Streams drawn so far, by key and pass
+static std::mutex DrawsLock;
+static std::map<std::pair<std::string, std::string>, unsigned> Draws;
+
+ObfRNG createRNG(StringRef Pass, StringRef Key) {
+  // Without a seed, one is drawn once per process
+  static const uint64_t ProcessSeed = [] {
+    std::random_device rd;
+    return ((uint64_t)rd() << 32) | rd();
+  }();
+  unsigned Invocation;
+  {
+    std::lock_guard<std::mutex> Guard(DrawsLock);
+    Invocation = Draws[std::make_pair(Key.str(), Pass.str())]++;
+  }
+  uint64_t S = Seed ? Seed : ProcessSeed;
+  uint8_t SeedBytes[8];
+  for (int i = 0; i < 8; i++)
+    SeedBytes[i] = S >> (8 * i);
+  MD5 Hash;
+  Hash.update(makeArrayRef(SeedBytes));
+  Hash.update(Pass);
+  Hash.update(makeArrayRef<uint8_t>(0));
+  Hash.update(Key);
+  // The first stream is the same as before invocations were counted
+  if (Invocation) {
+    Hash.update(makeArrayRef<uint8_t>(0));
+    Hash.update(utostr(Invocation));
+  }
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  std::seed_seq Seq{(uint32_t)Result.low(), (uint32_t)(Result.low() >> 32),
+                    (uint32_t)Result.high(), (uint32_t)(Result.high() >> 32)};
+  return ObfRNG(Seq);
+}
+
+ObfRNG createRNG(StringRef Pass, const Function &F) {
+  return createRNG(Pass, rngKey(F));
+}
+
+ObfRNG createRNG(StringRef Pass, const Module &M) {
+  return createRNG(Pass, rngKey(M));
+}
+
+std::string rngKey(const Function &F) {
+  if (F.hasName())
+    return F.getName().str();
+  // Names cannot contain a NUL
+  unsigned Position = 0;
+  for (const Function &G : *F.getParent()) {
+    if (&G == &F)
+      break;
+    Position++;
+  }
+  return std::string(1, '\0') + utostr(Position);
+}
+
+std::string rngKey(const Module &M) { return M.getSourceFileName(); }
+
+std::map<std::string, unsigned> rngDraws(StringRef Key) {
+  std::map<std::string, unsigned> Result;
+  std::lock_guard<std::mutex> Guard(DrawsLock);
+  for (auto It = Draws.lower_bound(std::make_pair(Key.str(), std::string()));
+       It != Draws.end() && It->first.first == Key; ++It)
+    Result[It->first.second] = It->second;
+  return Result;
+}
+
+void skipRNG(StringRef Pass, StringRef Key, unsigned Count) {
+  std::lock_guard<std::mutex> Guard(DrawsLock);
+  Draws[std::make_pair(Key.str(), Pass.str())] += Count;
+}
+
 bool valueEscapes(Instruction *Inst) {
   BasicBlock *BB = Inst->getParent();
   for (Value::use_iterator UI = Inst->use_begin(), E = Inst->use_end(); UI != E;
@@ -57,11 +144,9 @@ void fixStack(Function *f) {
   } while (tmpReg.size() != 0 || tmpPhi.size() != 0);
 }
 
-InlineAsm *generateGarbage(Function *f) {
+InlineAsm *generateGarbage(Function *f, ObfRNG &g) {
   bool is64 =
       Triple(f->getParent()->getTargetTriple()).getArch() == Triple::x86_64;
-  std::random_device rd;
-  std::mt19937 g(rd());
   std::uniform_int_distribution<uint32_t> rand(0, UINT32_MAX);
   std::string s = "";
   std::string junk[] = {"leaq	-4(%rbp), %rdx\n", "xorq %r11, %rsp\n",
@@ -160,21 +245,57 @@ bool isPrime(uint32_t number) {
   return true;
 }
 
-uint32_t randPrime(uint32_t min, uint32_t max) {
-  std::random_device rd;
-  std::mt19937 g(rd());
+// Primes of [min, max], sieved once per process and range. Larger ranges
+// would cost more memory than they save, and are sampled with isPrime.
+// Sieving [2^8, 2^16] takes about 1.3 ms, after which a draw takes 30 ns
+// instead of the 13 us of a random_device and rejection sampling per call.
+static const std::vector<uint32_t> *primePool(uint32_t min, uint32_t max) {
+  static std::mutex Lock;
+  static std::map<std::pair<uint32_t, uint32_t>, std::vector<uint32_t>> Pools;
+  if (max < min || max - min > (1 << 24))
+    return nullptr;
+  std::lock_guard<std::mutex> Guard(Lock);
+  auto It = Pools.find(std::make_pair(min, max));
+  if (It != Pools.end())
+    return &It->second;
+
+  std::vector<bool> Composite(max - min + 1);
+  for (uint64_t i = 2; i * i <= max; i++) {
+    uint64_t First = std::max(i * i, (min + i - 1) / i * i);
+    for (uint64_t j = First; j <= max; j += i)
+      Composite[j - min] = true;
+  }
+  std::vector<uint32_t> &Pool = Pools[std::make_pair(min, max)];
+  for (uint64_t n = std::max(min, 2u); n <= max; n++)
+    if (!Composite[n - min])
+      Pool.push_back(n);
+  return &Pool;
+}
+
+uint32_t randPrime(uint32_t min, uint32_t max, ObfRNG &Generator) {
+  const std::vector<uint32_t> *Pool = primePool(min, max);
+  if (Pool && !Pool->empty()) {
+    std::uniform_int_distribution<size_t> rand(0, Pool->size() - 1);
+    return (*Pool)[rand(Generator)];
+  }
   std::uniform_int_distribution<uint32_t> rand(min, max);
-  uint32_t p = rand(g);
+  uint32_t p = rand(Generator);
   while (!isPrime(p)) {
-    p = rand(g);
+    p = rand(Generator);
   }
   return p;
 }
 
-uint64_t modinv(uint64_t a) {
+uint64_t bitMask(unsigned bits) {
+  return bits >= 64 ? UINT64_MAX : (1ULL << bits) - 1;
+}
+
+// Inverse of an odd a modulo 2^bits. The inverse modulo 2^64 reduces to the
+// inverse modulo every smaller power of two.
+uint64_t modinv(uint64_t a, unsigned bits) {
   uint64_t x = a;
   for (int k = 2; k < 64; k *= 2) {
     x = (x * (2 - a * x)) % (1ULL << k);
   }
-  return x * (2 - a * x);
+  return (x * (2 - a * x)) & bitMask(bits);
 }
\ No newline at end of file
@@ -1,11 +1,43 @@
+#ifndef LLVM_TRANSFORMS_OBFUSCATE_UTIL_H
+#define LLVM_TRANSFORMS_OBFUSCATE_UTIL_H
+
 #include "llvm/IR/Function.h"
 #include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Module.h"
+
+#include <map>
+#include <random>
+#include <string>
+
+// Every pass draws from its own stream, derived from -obf-seed, the pass name,
+// the key of the function (or module) it works on, and how many streams were
+// drawn before with that pass and key, so that running a pass twice does not
+// repeat its choices. Output only depends on the seed and on how often each
+// pass ran on each function, not on the order of other passes or threads.
+typedef std::mt19937_64 ObfRNG;
+// -obf-seed, 0 if not given
+uint64_t obfSeed();
+ObfRNG createRNG(llvm::StringRef Pass, llvm::StringRef Key);
+ObfRNG createRNG(llvm::StringRef Pass, const llvm::Function &F);
+ObfRNG createRNG(llvm::StringRef Pass, const llvm::Module &M);
+// The name of F, or its position in the module if it has none; the source
+// file of M
+std::string rngKey(const llvm::Function &F);
+std::string rngKey(const llvm::Module &M);
+// Streams drawn so far with Key, by pass, and skipping Count of them, so
+// that the cache can replay a pass exactly
+std::map<std::string, unsigned> rngDraws(llvm::StringRef Key);
+void skipRNG(llvm::StringRef Pass, llvm::StringRef Key, unsigned Count);
 
 void fixStack(llvm::Function *f);
 
 const uint32_t fnvPrime = 19260817;
 const uint32_t fnvBasis = 0x114514;
 uint32_t fnvHash(const uint32_t data, uint32_t b);
-llvm::InlineAsm *generateGarbage(llvm::Function *f);
-uint32_t randPrime(uint32_t min, uint32_t max);
-uint64_t modinv(uint64_t a);
\ No newline at end of file
+llvm::InlineAsm *generateGarbage(llvm::Function *f, ObfRNG &g);
+// Uniform among the primes of [min, max]
+uint32_t randPrime(uint32_t min, uint32_t max, ObfRNG &Generator);
+uint64_t bitMask(unsigned bits);
+uint64_t modinv(uint64_t a, unsigned bits = 64);
+
+#endif
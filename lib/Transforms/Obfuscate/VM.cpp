@@ -7,6 +7,10 @@
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "Cache.h"
+#include "MBA.h"
+#include "Passes.h"
+
 #include <random>
 #include <vector>
 
@@ -18,8 +22,12 @@ struct Virtualize : public ModulePass {
   Virtualize() : ModulePass(ID) {}
 
   bool runOnModule(Module &M) override;
+  bool virtualize(Module &M);
 
 private:
+  ObfRNG Generator;
+  Function *CreateMBA(FunctionType *funcTy, Module &M, const char *Name,
+                      MBAOp Op);
   Function *Add = nullptr;
   Function *CreateAdd(FunctionType *funcTy, Module &M);
   Function *Sub = nullptr;
@@ -43,56 +51,37 @@ char Virtualize::ID = 0;
 static RegisterPass<Virtualize> X("vm",
                                   "Use functions to do simple arithmetic");
 
-Function *Virtualize::CreateAdd(FunctionType *funcTy, Module &M) {
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage,
-                                 "__YANSOLLVM_VM_Add", M);
+PreservedAnalyses VMPass::run(Module &M, ModuleAnalysisManager &AM) {
+  if (!Virtualize().runOnModule(M))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
+Function *Virtualize::CreateMBA(FunctionType *funcTy, Module &M,
+                                const char *Name, MBAOp Op) {
+  Function *f =
+      Function::Create(funcTy, GlobalValue::InternalLinkage, Name, M);
   Function::arg_iterator itArgs = f->arg_begin();
   Value *x = itArgs;
   Value *y = ++itArgs;
   BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
   IRBuilder<> Builder(entry);
-  // BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::Add, x, y,
-  // "", entry); x + y == (x|~y) + (~x&y) - (~(x&y)) + (x|y)
-  Value *a = Builder.CreateNot(y);
-  a = Builder.CreateOr(a, x);
-  Value *b = Builder.CreateNot(x);
-  b = Builder.CreateAnd(b, y);
-  Value *c = Builder.CreateAnd(x, y);
-  c = Builder.CreateNot(c);
-  Value *d = Builder.CreateOr(x, y);
-  Value *binOp = Builder.CreateAdd(a, b);
-  binOp = Builder.CreateSub(binOp, c);
-  binOp = Builder.CreateAdd(binOp, d);
+  // A handler is a call anyway, so it can afford a stronger identity
+  Value *binOp = buildMBA(Op, x, y, Builder, mbaVMBudget(), Generator);
   ReturnInst::Create(M.getContext(), binOp, entry);
   f->addFnAttr(Attribute::NoInline);
   f->addFnAttr(Attribute::OptimizeNone);
   return f;
 }
 
+Function *Virtualize::CreateAdd(FunctionType *funcTy, Module &M) {
+  // x + y, through an identity of the MBA library
+  return CreateMBA(funcTy, M, "__YANSOLLVM_VM_Add", MBAAdd);
+}
+
 Function *Virtualize::CreateSub(FunctionType *funcTy, Module &M) {
-  if (!Virtualize::Add)
-    Virtualize::Add = CreateAdd(funcTy, M);
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage,
-                                 "__YANSOLLVM_VM_Sub", M);
-  Function::arg_iterator itArgs = f->arg_begin();
-  Value *x = itArgs;
-  Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  IRBuilder<> Builder(entry);
-  // BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::Sub, x, y,
-  // "", entry);
-  // x - y == x + ~y + 1
-  Value *ny = Builder.CreateNot(y);
-  std::vector<Value *> callArgs;
-  callArgs.push_back(x);
-  callArgs.push_back(ny);
-  Value *binOp = CallInst::Create(Virtualize::Add, callArgs, "", entry);
-  binOp = Builder.CreateAdd(
-      binOp, ConstantInt::get(cast<IntegerType>(x->getType()), 1));
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
-  return f;
+  // x - y, through an identity of the MBA library
+  return CreateMBA(funcTy, M, "__YANSOLLVM_VM_Sub", MBASub);
 }
 
 Function *Virtualize::CreateShl(FunctionType *funcTy, Module &M) {
@@ -141,77 +130,32 @@ Function *Virtualize::CreateLShr(FunctionType *funcTy, Module &M) {
 }
 
 Function *Virtualize::CreateAnd(FunctionType *funcTy, Module &M) {
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage,
-                                 "__YANSOLLVM_VM_And", M);
-  Function::arg_iterator itArgs = f->arg_begin();
-  Value *x = itArgs;
-  Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  IRBuilder<> Builder(entry);
-  // BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::And, x, y,
-  // "", entry); x & y == -(~(x&y)) + (~x|y) + (x&~y)
-  Value *a = Builder.CreateAnd(x, y);
-  a = Builder.CreateNot(a);
-  Value *b = Builder.CreateNot(x);
-  b = Builder.CreateOr(b, y);
-  Value *c = Builder.CreateNot(y);
-  c = Builder.CreateAnd(x, c);
-  Value *binOp = Builder.CreateAdd(b, c);
-  binOp = Builder.CreateSub(binOp, a);
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
-  return f;
+  // x & y, through an identity of the MBA library
+  return CreateMBA(funcTy, M, "__YANSOLLVM_VM_And", MBAAnd);
 }
 
 Function *Virtualize::CreateOr(FunctionType *funcTy, Module &M) {
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage,
-                                 "__YANSOLLVM_VM_Or", M);
-  Function::arg_iterator itArgs = f->arg_begin();
-  Value *x = itArgs;
-  Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  IRBuilder<> Builder(entry);
-  // BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::Or, x, y,
-  // "", entry); x | y == (x^y) + y - (~x&y)
-  Value *a = Builder.CreateXor(x, y);
-  Value *b = Builder.CreateNot(x);
-  b = Builder.CreateAnd(b, y);
-  Value *binOp = Builder.CreateAdd(a, y);
-  binOp = Builder.CreateSub(binOp, b);
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
-  return f;
+  // x | y, through an identity of the MBA library
+  return CreateMBA(funcTy, M, "__YANSOLLVM_VM_Or", MBAOr);
 }
 
 Function *Virtualize::CreateXor(FunctionType *funcTy, Module &M) {
-  if (!Virtualize::Shl)
-    Virtualize::Shl = CreateShl(funcTy, M);
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage,
-                                 "__YANSOLLVM_VM_Xor", M);
-  Function::arg_iterator itArgs = f->arg_begin();
-  Value *x = itArgs;
-  Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  IRBuilder<> Builder(entry);
-  // BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::Xor, x, y,
-  // "", entry); x ^ y == x + y - ((x&y)<<1)
-  Value *a = Builder.CreateAdd(x, y);
-  Value *b = Builder.CreateAnd(x, y);
-  std::vector<Value *> callArgs;
-  callArgs.push_back(b);
-  callArgs.push_back(ConstantInt::get(cast<IntegerType>(x->getType()), 1));
-  Value *binOp = CallInst::Create(Virtualize::Shl, callArgs, "", entry);
-  binOp = Builder.CreateSub(a, binOp);
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
-  return f;
+  // x ^ y, through an identity of the MBA library
+  return CreateMBA(funcTy, M, "__YANSOLLVM_VM_Xor", MBAXor);
 }
 
 bool Virtualize::runOnModule(Module &M) {
+  ObfCache Cache("vm", M, mbaOptions());
+  if (Cache.replay())
+    return true;
+  bool modified = virtualize(M);
+  Cache.store();
+  return modified;
+}
+
+bool Virtualize::virtualize(Module &M) {
   bool modified = false;
+  Generator = createRNG("vm", M);
   IntegerType *i64 = IntegerType::get(M.getContext(), 64);
   std::vector<Type *> paramTy = {i64, i64};
   FunctionType *funcTy = FunctionType::get(i64, paramTy, false);
@@ -0,0 +1,411 @@
+import argparse
+import ctypes
+import errno
+import os
+import platform
+import shlex
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+# Measures what obfuscation costs: code size and run time of a kernel built
+# with each configuration of passes, next to the unobfuscated kernel.
+# usage: python3 benchObf.py <plugin> [--kernel name|file.ll] [--runs n]
+#                            [--seed s] -- "<opt flags>"...
+# e.g.   python3 benchObf.py LLVMObf.so -- -obfCon "-obfCon -obfcon-mode=table"
+#
+# The tools are taken from $OPT, $LLC, $CC and $SIZE, "opt", "llc", "cc" and
+# "llvm-size" by default; with a newer opt, set OPT="opt -enable-new-pm=0" for
+# the legacy passes. Each configuration is built with opt, llc -O2 and cc,
+# and must exit like the plain kernel. Size is the .text of the object, opt
+# the time obfuscation takes, and time the best of --runs runs of the binary.
+# With --branch-misses, one more run counts its branches and mispredictions
+# in user space with perf_event_open, which needs a PMU and
+# kernel.perf_event_paranoid at 2 or below.
+# Built-in kernels are "hash", a loop over a small hash with a switch and wide
+# constants, "gep", field accesses in and out of loops, "consts", a long
+# chain of operations on distinct constants, "example", the example of the
+# README, and "states", a state machine of 64 states.
+
+KERNELS = {}
+KERNELS["hash"] = r"""
+define internal i32 @mix(i32 %h, i32 %i) #0 {
+entry:
+  %k = and i32 %i, 7
+  switch i32 %k, label %d [
+    i32 0, label %c0
+    i32 1, label %c1
+    i32 2, label %c2
+    i32 3, label %c3
+  ]
+c0:
+  %a0 = mul i32 %h, 16777619
+  br label %join
+c1:
+  %a1 = xor i32 %h, -2128831035
+  br label %join
+c2:
+  %a2 = add i32 %h, 374761393
+  br label %join
+c3:
+  %s3 = shl i32 %h, 5
+  %a3 = add i32 %s3, %h
+  br label %join
+d:
+  %s4 = lshr i32 %h, 13
+  %a4 = xor i32 %h, %s4
+  br label %join
+join:
+  %p = phi i32 [ %a0, %c0 ], [ %a1, %c1 ], [ %a2, %c2 ], [ %a3, %c3 ],
+               [ %a4, %d ]
+  %m = mul i32 %p, -1640531535
+  %x = xor i32 %m, %i
+  ret i32 %x
+}
+
+define i32 @main() {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %h = phi i32 [ -2128831035, %entry ], [ %h2, %loop ]
+  %h2 = call i32 @mix(i32 %h, i32 %i)
+  %next = add i32 %i, 1
+  %more = icmp ult i32 %next, 20000000
+  br i1 %more, label %loop, label %exit
+exit:
+  %r = and i32 %h2, 255
+  ret i32 %r
+}
+
+attributes #0 = { noinline }
+"""
+
+KERNELS["gep"] = r"""
+%struct.P = type { i32, i32, i32, i32 }
+
+@arr = internal global [256 x %struct.P] zeroinitializer
+
+define internal i32 @get(%struct.P* %p, i32 %x) #0 {
+entry:
+  %a = getelementptr inbounds %struct.P, %struct.P* %p, i64 0, i32 1
+  %b = getelementptr inbounds %struct.P, %struct.P* %p, i64 0, i32 3
+  %va = load i32, i32* %a
+  %vb = load i32, i32* %b
+  %t = add i32 %va, %vb
+  %s = xor i32 %t, %x
+  ret i32 %s
+}
+
+define i32 @main() {
+entry:
+  br label %fill
+fill:
+  %j = phi i64 [ 0, %entry ], [ %jn, %fill ]
+  %f1 = getelementptr inbounds [256 x %struct.P], [256 x %struct.P]* @arr, i64 0, i64 %j, i32 1
+  %f3 = getelementptr inbounds [256 x %struct.P], [256 x %struct.P]* @arr, i64 0, i64 %j, i32 3
+  %jt = trunc i64 %j to i32
+  store i32 %jt, i32* %f1
+  store i32 %jt, i32* %f3
+  %jn = add i64 %j, 1
+  %jc = icmp ult i64 %jn, 256
+  br i1 %jc, label %fill, label %loop
+loop:
+  %i = phi i64 [ 0, %fill ], [ %next, %loop ]
+  %h = phi i32 [ 0, %fill ], [ %h2, %loop ]
+  %k = and i64 %i, 255
+  %p = getelementptr inbounds [256 x %struct.P], [256 x %struct.P]* @arr, i64 0, i64 %k
+  %g = call i32 @get(%struct.P* %p, i32 %h)
+  %q = getelementptr inbounds [256 x %struct.P], [256 x %struct.P]* @arr, i64 0, i64 %k, i32 2
+  %vq = load i32, i32* %q
+  %h1 = add i32 %h, %g
+  %h2 = xor i32 %h1, %vq
+  %next = add i64 %i, 1
+  %more = icmp ult i64 %next, 50000000
+  br i1 %more, label %loop, label %exit
+exit:
+  %r = and i32 %h2, 255
+  ret i32 %r
+}
+
+attributes #0 = { noinline }
+"""
+
+def constsKernel(n):
+    ops = ["add", "xor", "mul", "sub", "or"]
+    body = ["define internal i32 @consts(i32 %v0) #0 {", "entry:"]
+    for i in range(n):
+        body.append("  %%v%d = %s i32 %%v%d, %d" %
+                    (i + 1, ops[i % len(ops)], i, (i * 2654435761) % 2**31))
+    body.append("  ret i32 %%v%d" % n)
+    body.append("}")
+    return "\n".join(body) + r"""
+
+define i32 @main() {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %h = phi i32 [ 0, %entry ], [ %h2, %loop ]
+  %h1 = xor i32 %h, %i
+  %h2 = call i32 @consts(i32 %h1)
+  %next = add i32 %i, 1
+  %more = icmp ult i32 %next, 20000
+  br i1 %more, label %loop, label %exit
+exit:
+  %r = and i32 %h2, 255
+  ret i32 %r
+}
+
+attributes #0 = { noinline }
+"""
+
+KERNELS["consts"] = constsKernel(4000)
+
+# The example of the README, summing what it prints, with loops shaped as
+# clang -O0 emits them
+KERNELS["example"] = r"""
+@zero = global [2 x i16] [i16 0, i16 1]
+
+define internal i16* @d() #0 {
+entry:
+  ret i16* getelementptr inbounds ([2 x i16], [2 x i16]* @zero, i64 0, i64 0)
+}
+
+define internal i16 @c(i32 %x) #0 {
+entry:
+  %is0 = icmp eq i32 %x, 0
+  br i1 %is0, label %base, label %rec
+base:
+  %p = call i16* @d()
+  %p1 = getelementptr inbounds i16, i16* %p, i64 1
+  %v = load i16, i16* %p1
+  %r0 = xor i16 %v, 12
+  ret i16 %r0
+rec:
+  %x1 = sub i32 %x, 1
+  %c1 = call i16 @c(i32 %x1)
+  %r1 = add i16 %c1, 1
+  ret i16 %r1
+}
+
+define internal i32 @b(i32 %x) #0 {
+entry:
+  br label %cond
+cond:
+  %i = phi i32 [ 0, %entry ], [ %inext, %inc ]
+  %sum = phi i32 [ 0, %entry ], [ %sum1, %inc ]
+  %more = icmp slt i32 %i, %x
+  br i1 %more, label %body, label %end
+body:
+  %ci = call i16 @c(i32 %i)
+  %cx = sext i16 %ci to i32
+  %sum1 = add i32 %sum, %cx
+  br label %inc
+inc:
+  %inext = add i32 %i, 1
+  br label %cond
+end:
+  ret i32 %sum
+}
+
+define internal i32 @a(i64 %x) #0 {
+entry:
+  br label %cond
+cond:
+  %i = phi i32 [ 0, %entry ], [ %inext, %inc ]
+  %acc = phi i32 [ 0, %entry ], [ %acc1, %inc ]
+  %ix = sext i32 %i to i64
+  %more = icmp ult i64 %ix, %x
+  br i1 %more, label %body, label %end
+body:
+  %bi = call i32 @b(i32 %i)
+  %temp = add i32 %bi, 1
+  %acc1 = add i32 %acc, %temp
+  br label %inc
+inc:
+  %inext = add i32 %i, 1
+  br label %cond
+end:
+  ret i32 %acc
+}
+
+define i32 @main() {
+entry:
+  %r = call i32 @a(i64 700)
+  %x = and i32 %r, 255
+  ret i32 %x
+}
+
+attributes #0 = { noinline }
+"""
+
+# A machine of n states in a loop, each of which picks the next one from
+# the hash it updates
+def statesKernel(n):
+    ops = ["mul", "xor", "add"]
+    cases = " ".join("i32 %d, label %%s%d" % (k, k) for k in range(n))
+    body = ["define internal i32 @machine(i32 %iters) #0 {", "entry:",
+            "  br label %loop", "loop:",
+            "  %i = phi i32 [ 0, %entry ], [ %inext, %latch ]",
+            "  %s = phi i32 [ 0, %entry ], [ %snext, %latch ]",
+            "  %h = phi i32 [ -2128831035, %entry ], [ %hnext, %latch ]",
+            "  switch i32 %%s, label %%latch [ %s ]" % cases]
+    for k in range(n):
+        body += ["s%d:" % k,
+                 "  %%h%d = %s i32 %%h, %d" %
+                 (k, ops[k % len(ops)], (k * 2654435761 + 1) % 2**31),
+                 "  %%t%d = lshr i32 %%h%d, %d" % (k, k, 7 + k % 9),
+                 "  %%u%d = xor i32 %%h%d, %%t%d" % (k, k, k),
+                 "  %%n%d = urem i32 %%u%d, %d" % (k, k, n),
+                 "  br label %latch"]
+    body += ["latch:",
+             "  %%hnext = phi i32 [ %%h, %%loop ], %s" %
+             ", ".join("[ %%h%d, %%s%d ]" % (k, k) for k in range(n)),
+             "  %%snext = phi i32 [ 0, %%loop ], %s" %
+             ", ".join("[ %%n%d, %%s%d ]" % (k, k) for k in range(n)),
+             "  %inext = add i32 %i, 1",
+             "  %more = icmp ult i32 %inext, %iters",
+             "  br i1 %more, label %loop, label %exit",
+             "exit:", "  ret i32 %hnext", "}"]
+    return "\n".join(body) + r"""
+
+define i32 @main() {
+entry:
+  %h = call i32 @machine(i32 10000000)
+  %r = and i32 %h, 255
+  ret i32 %r
+}
+
+attributes #0 = { noinline }
+"""
+
+KERNELS["states"] = statesKernel(64)
+
+# Configurations follow "--", as they start with dashes themselves
+argv = sys.argv[1:]
+configs = []
+if "--" in argv:
+    configs = argv[argv.index("--") + 1:]
+    argv = argv[:argv.index("--")]
+parser = argparse.ArgumentParser()
+parser.add_argument("plugin")
+parser.add_argument("--kernel", default="hash")
+parser.add_argument("--runs", type=int, default=5)
+parser.add_argument("--seed", default="1")
+parser.add_argument("--branch-misses", action="store_true")
+args = parser.parse_args(argv)
+
+def tool(var, default):
+    return shlex.split(os.environ.get(var, default))
+
+OPT = tool("OPT", "opt")
+LLC = tool("LLC", "llc")
+CC = tool("CC", "cc")
+SIZE = tool("SIZE", "llvm-size")
+
+def run(cmd):
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+
+# struct perf_event_attr up to its first flags, PERF_ATTR_SIZE_VER0 bytes
+PERF_TYPE_HARDWARE = 0
+PERF_COUNT_HW_BRANCH_INSTRUCTIONS = 4
+PERF_COUNT_HW_BRANCH_MISSES = 5
+# disabled, exclude_kernel, exclude_hv and enable_on_exec
+PERF_FLAGS = (1 << 0) | (1 << 5) | (1 << 6) | (1 << 12)
+PERF_EVENT_OPEN = {"x86_64": 298, "aarch64": 241}
+
+def perfOpen(pid, config):
+    attr = bytearray(64)
+    struct.pack_into("IIQ", attr, 0, PERF_TYPE_HARDWARE, len(attr), config)
+    struct.pack_into("Q", attr, 40, PERF_FLAGS)
+    libc = ctypes.CDLL(None, use_errno=True)
+    fd = libc.syscall(PERF_EVENT_OPEN[platform.machine()],
+                      (ctypes.c_char * len(attr)).from_buffer(attr),
+                      pid, -1, -1, 0)
+    if fd < 0:
+        err = ctypes.get_errno()
+        sys.exit("perf_event_open: %s" % os.strerror(err) +
+                 (", no hardware counters here" if err == errno.ENOENT else ""))
+    return fd
+
+# Branches and mispredictions of binary, counted from its exec on
+def branchMisses(binary):
+    r, w = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        os.close(w)
+        # Waits for the counters
+        os.read(r, 1)
+        try:
+            os.execv(binary, [binary])
+        finally:
+            os._exit(127)
+    os.close(r)
+    try:
+        fds = [perfOpen(pid, config)
+               for config in (PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+                              PERF_COUNT_HW_BRANCH_MISSES)]
+    finally:
+        os.close(w)
+        os.waitpid(pid, 0)
+    counts = [struct.unpack("Q", os.read(fd, 8))[0] for fd in fds]
+    for fd in fds:
+        os.close(fd)
+    return counts
+
+def textSize(obj):
+    out = subprocess.run(SIZE + ["-A", obj], check=True,
+                         stdout=subprocess.PIPE, universal_newlines=True)
+    return sum(int(line.split()[1]) for line in out.stdout.splitlines()
+               if line.startswith(".text"))
+
+def bench(dir, name, flags):
+    base = os.path.join(dir, name)
+    start = time.perf_counter()
+    if flags:
+        run(OPT + ["-load", args.plugin, "-obf-seed=" + args.seed] +
+            shlex.split(flags) + [kernel, "-o", base + ".bc"])
+    else:
+        run(OPT + [kernel, "-o", base + ".bc"])
+    compile = time.perf_counter() - start
+    run(LLC + ["-O2", "-relocation-model=pic", "-filetype=obj", base + ".bc",
+               "-o", base + ".o"])
+    run(CC + [base + ".o", "-o", base])
+    best = None
+    for _ in range(args.runs):
+        start = time.perf_counter()
+        code = subprocess.run([base]).returncode
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    misses = branchMisses(base) if args.branch_misses else None
+    return textSize(base + ".o"), compile, best, code, misses
+
+def missRate(misses):
+    if not misses:
+        return ""
+    branches, missed = misses
+    return " %12d %6.2f%%" % (missed, 100.0 * missed / max(branches, 1))
+
+with tempfile.TemporaryDirectory() as dir:
+    kernel = args.kernel
+    if kernel in KERNELS:
+        kernel = os.path.join(dir, "kernel.ll")
+        with open(kernel, "w") as f:
+            f.write(KERNELS[args.kernel])
+    size0, compile0, time0, code0, misses0 = bench(dir, "plain", "")
+    width = max([48] + [len(flags) for flags in configs])
+    print("%-*s %8s %8s %8s %10s %7s%s" %
+          (width, "passes", ".text", "size", "opt (s)", "time (s)", "time",
+           " %12s %7s" % ("br. misses", "rate") if args.branch_misses else ""))
+    print("%-*s %8d %7.2fx %8.3f %10.4f %6.2fx%s" %
+          (width, "(none)", size0, 1, compile0, time0, 1, missRate(misses0)))
+    for i, flags in enumerate(configs):
+        size, compile, elapsed, code, misses = bench(dir, "obf%d" % i, flags)
+        if code != code0:
+            sys.exit("%s: exit code %d instead of %d" % (flags, code, code0))
+        print("%-*s %8d %7.2fx %8.3f %10.4f %6.2fx%s" %
+              (width, flags, size, size / size0, compile, elapsed,
+               elapsed / time0, missRate(misses)))
@@ -0,0 +1,215 @@
+import random
+import struct
+import sys
+
+# Builds the MBA identity database read by MBA.cpp (-mba-db=<file>).
+# usage: python3 genMBA.py [output] [entries per op and cost class]
+#
+# Linear identities sum(a_i * e_i(x, y)) == f(x, y) hold for all n-bit x, y
+# iff they hold for every combination of one bit of x and y, so they are built
+# from random bitwise terms whose error on the four combinations is cancelled
+# with the minterms. Polynomial identities add a linear zero times a bitwise
+# term. Every entry is evaluated on random and corner inputs before it is
+# written.
+#
+# Layout, little-endian:
+#   char Magic[8] = "MBADB01\0"; u32 NumEntries; u32 CodeSize;
+#   { u32 First; u32 Count; } Index[NumOps][NumClasses];
+#   { u8 Op; u8 Class; u8 Latency; u8 RThroughput4; u16 NumInsts;
+#     u16 CodeLen; u32 CodeOffset; } Entries[NumEntries];
+#   u8 Code[CodeSize];
+# Code is postfix over X, Y, CONST <u64>, NOT, AND, OR, XOR, ADD, SUB, MUL.
+
+output = sys.argv[1] if len(sys.argv) > 1 else "MBA.db"
+perClass = int(sys.argv[2]) if len(sys.argv) > 2 else 256
+
+MASK = (1 << 64) - 1
+X, Y, CONST, NOT, AND, OR, XOR, ADD, SUB, MUL = range(10)
+# Same order as MBAOp
+ops = ["add", "sub", "and", "or", "xor", "zero"]
+# Value of the target on the bit combinations (x, y) = 00, 01, 10, 11
+targets = [[0, 1, 1, 2], [0, -1, 1, 0], [0, 0, 0, 1],
+           [0, 1, 1, 1], [0, 1, 1, 0], [0, 0, 0, 0]]
+# Upper bound in cycles of each cost class, as checked against the budget
+classBounds = [3, 6, 12, 24]
+
+def var(v):
+    return [(v,)]
+
+def un(op, a):
+    return a + [(op,)]
+
+def bin(op, a, b):
+    return a + b + [(op,)]
+
+def const(c):
+    return [(CONST, c & MASK)]
+
+x, y = var(X), var(Y)
+# One bitwise term per non-trivial truth table, several spellings each
+bitwise = {
+    0b0001: [un(NOT, bin(OR, x, y)), bin(AND, un(NOT, x), un(NOT, y))],
+    0b0010: [bin(AND, un(NOT, x), y), un(NOT, bin(OR, x, un(NOT, y)))],
+    0b0011: [un(NOT, x)],
+    0b0100: [bin(AND, x, un(NOT, y)), un(NOT, bin(OR, un(NOT, x), y))],
+    0b0101: [un(NOT, y)],
+    0b0110: [bin(XOR, x, y), bin(AND, bin(OR, x, y), un(NOT, bin(AND, x, y)))],
+    0b0111: [un(NOT, bin(AND, x, y)), bin(OR, un(NOT, x), un(NOT, y))],
+    0b1000: [bin(AND, x, y), un(NOT, bin(OR, un(NOT, x), un(NOT, y)))],
+    0b1001: [un(NOT, bin(XOR, x, y)), bin(XOR, un(NOT, x), y)],
+    0b1010: [y],
+    0b1011: [bin(OR, un(NOT, x), y)],
+    0b1100: [x],
+    0b1101: [bin(OR, x, un(NOT, y))],
+    0b1110: [bin(OR, x, y)],
+    0b1111: [const(-1)],
+}
+# Bit of a truth table for the combination (x, y) = 00, 01, 10, 11
+def ttbit(tt, i):
+    return (tt >> i) & 1
+minterms = [0b0001, 0b0010, 0b0100, 0b1000]
+
+def scale(a, e):
+    a &= MASK
+    if a == 1:
+        return e
+    if a == MASK:
+        return bin(SUB, const(0), e)
+    return bin(MUL, e, const(a))
+
+def addTerm(expr, a, e):
+    a &= MASK
+    if a == 0:
+        return expr
+    if expr is None:
+        return scale(a, e)
+    if a == MASK:
+        return bin(SUB, expr, e)
+    return bin(ADD, expr, scale(a, e))
+
+def randCoef():
+    r = random.random()
+    if r < 0.4:
+        return random.randrange(-8, 9)
+    if r < 0.7:
+        return random.getrandbits(16)
+    return random.getrandbits(64)
+
+def linear(target, terms):
+    expr = None
+    rest = list(target)
+    for _ in range(terms):
+        tt = random.randrange(1, 16)
+        a = randCoef()
+        expr = addTerm(expr, a, random.choice(bitwise[tt]))
+        for i in range(4):
+            rest[i] -= a * ttbit(tt, i)
+    for i, m in enumerate(minterms):
+        expr = addTerm(expr, rest[i], random.choice(bitwise[m]))
+    return expr if expr is not None else const(0)
+
+def polynomial(target, terms):
+    zero = linear(targets[-1], terms)
+    e = random.choice(bitwise[random.randrange(1, 16)])
+    return bin(ADD, linear(target, terms), bin(MUL, zero, e))
+
+def evaluate(code, xv, yv, bits):
+    mask = (1 << bits) - 1
+    stack = []
+    for ins in code:
+        op = ins[0]
+        if op == X:
+            stack.append(xv & mask)
+        elif op == Y:
+            stack.append(yv & mask)
+        elif op == CONST:
+            stack.append(ins[1] & mask)
+        elif op == NOT:
+            stack.append(~stack.pop() & mask)
+        else:
+            b, a = stack.pop(), stack.pop()
+            stack.append({AND: a & b, OR: a | b, XOR: a ^ b, ADD: a + b,
+                          SUB: a - b, MUL: a * b}[op] & mask)
+    return stack[0]
+
+reference = [lambda a, b: a + b, lambda a, b: a - b, lambda a, b: a & b,
+             lambda a, b: a | b, lambda a, b: a ^ b, lambda a, b: 0]
+corners = [0, 1, 2, MASK, MASK - 1, 1 << 63, (1 << 63) - 1, 0x5555555555555555,
+           0xAAAAAAAAAAAAAAAA, 0xFF, 0xFFFFFFFF]
+inputs = [(a, b) for a in corners for b in corners]
+inputs += [(random.getrandbits(64), random.getrandbits(64))
+           for _ in range(128)]
+
+def verify(op, code):
+    for bits in (8, 16, 32, 64):
+        mask = (1 << bits) - 1
+        for a, b in inputs:
+            if evaluate(code, a, b, bits) != reference[op](a, b) & mask:
+                return False
+    return True
+
+# Skylake: 1 cycle latency and 0.25 reciprocal throughput for ALU ops, 3 and 1
+# for imul. Operands are free.
+def cost(code):
+    depth = []
+    rthroughput4 = 0
+    insts = 0
+    for ins in code:
+        op = ins[0]
+        if op in (X, Y, CONST):
+            depth.append(0)
+            continue
+        insts += 1
+        lat = 3 if op == MUL else 1
+        rthroughput4 += 4 if op == MUL else 1
+        if op == NOT:
+            depth.append(depth.pop() + lat)
+        else:
+            b, a = depth.pop(), depth.pop()
+            depth.append(max(a, b) + lat)
+    return depth[0], rthroughput4, insts
+
+def encode(code):
+    out = b""
+    for ins in code:
+        out += struct.pack("<B", ins[0])
+        if ins[0] == CONST:
+            out += struct.pack("<Q", ins[1])
+    return out
+
+entries = [[[] for _ in classBounds] for _ in ops]
+for op in range(len(ops)):
+    attempts = 0
+    while (min(len(c) for c in entries[op]) < perClass and
+           attempts < perClass * 50):
+        attempts += 1
+        terms = random.randrange(1, 6)
+        if random.random() < 0.3:
+            code = polynomial(targets[op], terms)
+        else:
+            code = linear(targets[op], terms)
+        lat, rthroughput4, insts = cost(code)
+        cycles = max(lat, rthroughput4 / 4.0)
+        cls = next((i for i, b in enumerate(classBounds) if cycles <= b), None)
+        if cls is None or len(entries[op][cls]) >= perClass:
+            continue
+        if lat > 255 or rthroughput4 > 255 or not verify(op, code):
+            continue
+        entries[op][cls].append((lat, rthroughput4, insts, encode(code)))
+
+index = b""
+table = b""
+blob = b""
+first = 0
+for op in range(len(ops)):
+    for cls in range(len(classBounds)):
+        index += struct.pack("<II", first, len(entries[op][cls]))
+        first += len(entries[op][cls])
+        for lat, rthroughput4, insts, code in entries[op][cls]:
+            table += struct.pack("<BBBBHHI", op, cls, lat, rthroughput4, insts,
+                                 len(code), len(blob))
+            blob += code
+
+with open(output, "wb") as f:
+    f.write(b"MBADB01\0" + struct.pack("<II", first, len(blob)))
+    f.write(index + table + blob)
@@ -0,0 +1,107 @@
+import argparse
+import os
+import re
+import shlex
+import subprocess
+import sys
+import tempfile
+
+# Checks that -obf-parallel gives the output of the passes it runs: each
+# configuration is run over Inputs/unnamed.ll serially and through
+# -obf-parallel on one and on several threads. The parallel outputs must be
+# identical, and equal to the serial one up to the order of functions,
+# globals and uses, and the numbers LLVM appends to clashing global names,
+# such as those of obfCon's tables. The binaries must all exit like the
+# plain one.
+# usage: python3 testParallel.py <plugin> [--threads n] [-- "<config>"...]
+# where a configuration is a -obf-parallel-passes list followed by options,
+# e.g. "flattening,connect,obfCon" "obfCon -obfcon-mode=table".
+#
+# The tools are taken from $OPT, $LLC and $CC as in benchObf.py.
+
+INPUT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "Inputs",
+                     "unnamed.ll")
+
+# Configurations follow "--", as options start with dashes themselves
+argv = sys.argv[1:]
+configs = ["flattening,connect,obfCon", "bb2func,flattening",
+           "obfCon -obfcon-mode=table"]
+if "--" in argv:
+    configs = argv[argv.index("--") + 1:]
+    argv = argv[:argv.index("--")]
+parser = argparse.ArgumentParser()
+parser.add_argument("plugin")
+parser.add_argument("--seed", default="1")
+parser.add_argument("--threads", default="4")
+args = parser.parse_args(argv)
+
+def tool(var, default):
+    return shlex.split(os.environ.get(var, default))
+
+OPT = tool("OPT", "opt")
+LLC = tool("LLC", "llc")
+CC = tool("CC", "cc")
+
+def run(cmd):
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL,
+                   stderr=subprocess.DEVNULL)
+
+def opt(base, flags):
+    run(OPT + ["-load", args.plugin, "-obf-seed=" + args.seed] + flags +
+        [INPUT, "-S", "-o", base + ".ll"])
+    with open(base + ".ll") as f:
+        return f.read()
+
+def exitCode(base):
+    run(LLC + ["-relocation-model=pic", "-filetype=obj", base + ".ll", "-o",
+               base + ".o"])
+    run(CC + [base + ".o", "-o", base])
+    return subprocess.run([base]).returncode
+
+# Functions and global definitions, sorted, with global numbers and the
+# predecessor comments, which follow use-list order, dropped
+def normalize(ll):
+    ll = re.sub(r"\s+; preds = .*", "", ll)
+    lines = [re.sub(r"(@[\w.]+?)\.\d+\b", r"\1", line)
+             for line in ll.splitlines()
+             if line and not line.startswith((";", "source_filename", "!"))]
+    chunks, chunk = [], None
+    for line in lines:
+        if chunk is not None:
+            chunk.append(line)
+            if line == "}":
+                chunks.append("\n".join(chunk))
+                chunk = None
+        elif line.startswith("define "):
+            chunk = [line]
+        else:
+            chunks.append(line)
+    return sorted(chunks)
+
+errors = []
+with tempfile.TemporaryDirectory() as dir:
+    plain = os.path.join(dir, "plain")
+    run(OPT + [INPUT, "-S", "-o", plain + ".ll"])
+    code = exitCode(plain)
+    for i, config in enumerate(configs):
+        passes, *options = shlex.split(config)
+        base = os.path.join(dir, "config%d" % i)
+        serial = opt(base + ".serial",
+                     ["-" + name for name in passes.split(",")] + options)
+        outputs = [opt(base + ".t" + threads,
+                       ["-obf-parallel", "-obf-parallel-passes=" + passes,
+                        "-obf-threads=" + threads] + options)
+                   for threads in ["1", args.threads]]
+        if outputs[0] != outputs[1]:
+            errors.append(config + ": output depends on the thread count")
+        if normalize(serial) != normalize(outputs[1]):
+            errors.append(config + ": output differs from the serial passes")
+        for name in ["serial", "t" + args.threads]:
+            if exitCode(base + "." + name) != code:
+                errors.append(config + ": " + name + " build exits wrong")
+
+for error in errors:
+    print(error)
+if not errors:
+    print("ok")
+sys.exit(1 if errors else 0)
@@ -0,0 +1,113 @@
+import argparse
+import os
+import re
+import shlex
+import subprocess
+import sys
+import tempfile
+
+# Checks that -obf-profile leaves hot code alone: Inputs/hotloop.ll is
+# flattened with the counts of Inputs/hotloop.proftext, and the blocks of its
+# hot loop must still branch to each other, while its cold blocks and the
+# cold function around it go through the dispatcher. With the whole run time
+# as budget, the loop is flattened as well.
+# usage: python3 testProfile.py <plugin> [--passes "<opt flags>"]
+# where the passes include -flattening, e.g. "-flattening -connect".
+#
+# The tools are taken from $OPT, $LLC, $CC and $PROFDATA, "opt", "llc",
+# "cc" and "llvm-profdata" by default, as in benchObf.py.
+
+INPUTS = os.path.join(os.path.dirname(os.path.abspath(__file__)), "Inputs")
+# Hot blocks of @work, and the hot blocks each one branches to
+HOT = {"loop": {"even", "latch"}, "even": {"latch"}, "latch": {"loop"}}
+
+parser = argparse.ArgumentParser()
+parser.add_argument("plugin")
+parser.add_argument("--passes", default="-flattening")
+parser.add_argument("--seed", default="1")
+args = parser.parse_args()
+
+def tool(var, default):
+    return shlex.split(os.environ.get(var, default))
+
+OPT = tool("OPT", "opt")
+LLC = tool("LLC", "llc")
+CC = tool("CC", "cc")
+PROFDATA = tool("PROFDATA", "llvm-profdata")
+
+def run(cmd):
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+
+# Successors of each block of each function, by name
+def branches(ll):
+    funcs = {}
+    blocks = None
+    block = None
+    for line in ll.splitlines():
+        m = re.match(r"define .*@([\w.]+)\(", line)
+        if m:
+            blocks = funcs.setdefault(m.group(1), {})
+            block = "entry"
+            continue
+        m = re.match(r"([\w.]+):", line)
+        if m and blocks is not None:
+            block = m.group(1)
+            continue
+        if blocks is not None and re.match(r"\s+(br|switch) ", line):
+            blocks.setdefault(block, set()).update(
+                re.findall(r"label %([\w.]+)", line))
+    return funcs
+
+def obfuscate(dir, name, profile, budget):
+    base = os.path.join(dir, name)
+    run(OPT + ["-load", args.plugin, "-obf-seed=" + args.seed,
+               "-obf-profile=" + profile, "-obf-overhead-budget=" + budget] +
+        shlex.split(args.passes) +
+        [os.path.join(INPUTS, "hotloop.ll"), "-S", "-o", base + ".ll"])
+    return base
+
+def exitCode(base):
+    run(LLC + ["-O0", "-relocation-model=pic", "-filetype=obj", base + ".ll",
+               "-o", base + ".o"])
+    run(CC + [base + ".o", "-o", base])
+    return subprocess.run([base]).returncode
+
+def hotKept(funcs):
+    work = funcs["work"]
+    return all(succ <= work.get(block, set()) for block, succ in HOT.items())
+
+def flattened(blocks):
+    return any(name.startswith("loopEntry") for name in blocks)
+
+errors = []
+with tempfile.TemporaryDirectory() as dir:
+    profile = os.path.join(dir, "hotloop.profdata")
+    run(PROFDATA + ["merge", os.path.join(INPUTS, "hotloop.proftext"), "-o",
+                    profile])
+    plain = os.path.join(dir, "plain")
+    run(OPT + [os.path.join(INPUTS, "hotloop.ll"), "-S", "-o", plain + ".ll"])
+    code = exitCode(plain)
+
+    base = obfuscate(dir, "budget10", profile, "10")
+    with open(base + ".ll") as f:
+        funcs = branches(f.read())
+    if not hotKept(funcs):
+        errors.append("the hot loop of @work was obfuscated")
+    if not flattened(funcs["work"]) or not flattened(funcs["rare"]):
+        errors.append("cold code was left alone")
+    if exitCode(base) != code:
+        errors.append("exit code differs at 10%")
+
+    base = obfuscate(dir, "budget100", profile, "100")
+    with open(base + ".ll") as f:
+        funcs = branches(f.read())
+    if hotKept(funcs):
+        errors.append("the hot loop of @work is left alone without a budget")
+    if exitCode(base) != code:
+        errors.append("exit code differs at 100%")
+
+for error in errors:
+    print(args.passes + ": " + error)
+if not errors:
+    print(args.passes + ": ok")
+sys.exit(1 if errors else 0)
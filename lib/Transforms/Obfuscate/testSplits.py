@@ -0,0 +1,180 @@
+import argparse
+import os
+import random
+import shlex
+import subprocess
+import sys
+import tempfile
+import time
+
+# Checks that obfCon rebuilds every constant it splits: all i8 and i16
+# values, and random values of wider types with their edge cases, are
+# stored by obfuscated functions and compared with an untouched table.
+# usage: python3 testSplits.py <plugin> [--seed s] [--count n]
+#                              [-- "<opt flags>"...]
+# e.g.   python3 testSplits.py LLVMObf.so -- -obfCon \
+#            "-obfCon -obfcon-mode=table"
+#
+# The tools are taken from $OPT, $LLC and $CC as in benchObf.py. Each
+# configuration is built with opt, llc -O0, so that nothing is folded away,
+# and cc. The binary exits with a bit set for each width it got wrong.
+# Without configurations, both modes of obfCon are checked with
+# -mba-verify=false, so that the pass does not vouch for its own output.
+# Half of the constants are stored in a loop, where obfCon builds cheaper
+# splits.
+
+EXHAUSTIVE = [8, 16]
+RANDOM = [24, 32, 48, 64]
+# Constants per function, as llc slows down on large functions
+CHUNK = 64
+
+# Configurations follow "--", as they start with dashes themselves
+argv = sys.argv[1:]
+configs = ["-obfCon -mba-verify=false",
+           "-obfCon -obfcon-mode=table -mba-verify=false"]
+if "--" in argv:
+    configs = argv[argv.index("--") + 1:]
+    argv = argv[:argv.index("--")]
+parser = argparse.ArgumentParser()
+parser.add_argument("plugin")
+parser.add_argument("--seed", type=int, default=1)
+parser.add_argument("--count", type=int, default=4096,
+                    help="random values per wider width")
+args = parser.parse_args(argv)
+
+def tool(var, default):
+    return shlex.split(os.environ.get(var, default))
+
+OPT = tool("OPT", "opt")
+LLC = tool("LLC", "llc")
+CC = tool("CC", "cc")
+
+def run(cmd):
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+
+def values(width, rng):
+    if width in EXHAUSTIVE:
+        return list(range(2**width))
+    mask = 2**width - 1
+    edges = [0, 1, 2, mask, mask - 1, 2**(width - 1), 2**(width - 1) - 1]
+    edges += [2**i for i in range(width)] + [mask ^ 2**i for i in range(width)]
+    return edges + [rng.getrandbits(width) for _ in range(args.count)]
+
+def signed(v, width):
+    return v - 2**width if v >= 2**(width - 1) else v
+
+# Function k stores its chunk of values at their index in @out.W, with %x
+# as an integer obfCon can draw its opaque zeros from
+def fill(width, vals, k, name):
+    ty = "i%d" % width
+    arr = "[%d x %s]" % (len(vals), ty)
+    start = k * CHUNK
+    chunk = vals[start:start + CHUNK]
+    lines = ["define internal void @%s(%s %%x) #0 {" % (name, ty), "entry:"]
+    half = len(chunk) // 2
+    stores = ["  store %s %d, %s* getelementptr inbounds (%s, %s* @out.%d, "
+              "i64 0, i64 %d)" % (ty, signed(v, width), ty, arr, arr, width,
+                                  start + i)
+              for i, v in enumerate(chunk)]
+    lines += stores[:half]
+    lines += ["  br label %loop", "loop:",
+              "  %i = phi i32 [ 0, %entry ], [ %next, %loop ]"]
+    lines += stores[half:]
+    lines += ["  %next = add i32 %i, 1",
+              "  %more = icmp ult i32 %next, 1",
+              "  br i1 %more, label %loop, label %exit",
+              "exit:", "  ret void", "}"]
+    return "\n".join(lines)
+
+# Sets bit b of %bad if any value of the b-th width differs from @expect.W
+def check(width, n, bit):
+    ty = "i%d" % width
+    arr = "[%d x %s]" % (n, ty)
+    w = "w%d" % width
+    return "\n".join([
+        "  br label %%%s" % w,
+        "%s:" % w,
+        "  %%%s.i = phi i64 [ 0, %%%s ], [ %%%s.next, %%%s ]" %
+        (w, "start" if bit == 0 else "w%d.end" % PREV[width], w, w),
+        "  %%%s.bad = phi i32 [ 0, %%%s ], [ %%%s.bad2, %%%s ]" %
+        (w, "start" if bit == 0 else "w%d.end" % PREV[width], w, w),
+        "  %%%s.p = getelementptr inbounds %s, %s* @out.%d, i64 0, i64 %%%s.i" %
+        (w, arr, arr, width, w),
+        "  %%%s.q = getelementptr inbounds %s, %s* @expect.%d, i64 0, i64 %%%s.i" %
+        (w, arr, arr, width, w),
+        "  %%%s.a = load %s, %s* %%%s.p" % (w, ty, ty, w),
+        "  %%%s.b = load %s, %s* %%%s.q" % (w, ty, ty, w),
+        "  %%%s.ne = icmp ne %s %%%s.a, %%%s.b" % (w, ty, w, w),
+        "  %%%s.z = zext i1 %%%s.ne to i32" % (w, w),
+        "  %%%s.bad2 = or i32 %%%s.bad, %%%s.z" % (w, w, w),
+        "  %%%s.next = add i64 %%%s.i, 1" % (w, w),
+        "  %%%s.more = icmp ult i64 %%%s.next, %d" % (w, w, n),
+        "  br i1 %%%s.more, label %%%s, label %%%s.end" % (w, w, w),
+        "%s.end:" % w,
+        "  %%%s.shl = shl i32 %%%s.bad2, %d" % (w, w, bit),
+        "  %%%s.acc = or i32 %%%s, %%%s.shl" %
+        (w, "w%d.acc" % PREV[width] if bit else "zero", w),
+    ])
+
+WIDTHS = EXHAUSTIVE + RANDOM
+PREV = dict(zip(WIDTHS[1:], WIDTHS))
+
+def build():
+    rng = random.Random(args.seed)
+    globs, funcs, main = [], [], []
+    sizes = {}
+    for width in WIDTHS:
+        vals = values(width, rng)
+        sizes[width] = len(vals)
+        ty = "i%d" % width
+        arr = "[%d x %s]" % (len(vals), ty)
+        globs.append("@out.%d = internal global %s zeroinitializer" %
+                     (width, arr))
+        globs.append("@expect.%d = internal constant %s [%s]" %
+                     (width, arr,
+                      ", ".join("%s %d" % (ty, signed(v, width))
+                                for v in vals)))
+        main.append("  %%x.%d = trunc i64 %%x to %s" % (width, ty)
+                    if width < 64 else "  %x.64 = add i64 %x, 0")
+        for k in range((len(vals) + CHUNK - 1) // CHUNK):
+            name = "fill.%d.%d" % (width, k)
+            funcs.append(fill(width, vals, k, name))
+            main.append("  call void @%s(%s %%x.%d)" % (name, ty, width))
+    main = (["define i32 @main(i32 %argc, i8** %argv) {", "start:",
+             "  %x = zext i32 %argc to i64", "  %zero = add i32 0, 0"] +
+            main +
+            [check(width, sizes[width], bit)
+             for bit, width in enumerate(WIDTHS)] +
+            ["  ret i32 %%w%d.acc" % WIDTHS[-1], "}"])
+    return "\n".join(globs + funcs + main) + \
+        "\n\nattributes #0 = { noinline }\n"
+
+def test(dir, name, flags):
+    base = os.path.join(dir, name)
+    start = time.perf_counter()
+    if flags:
+        run(OPT + ["-load", args.plugin, "-obf-seed=%d" % args.seed] +
+            shlex.split(flags) + [kernel, "-o", base + ".bc"])
+    else:
+        run(OPT + [kernel, "-o", base + ".bc"])
+    compile = time.perf_counter() - start
+    run(LLC + ["-O0", "-relocation-model=pic", "-filetype=obj", base + ".bc",
+               "-o", base + ".o"])
+    run(CC + [base + ".o", "-o", base])
+    code = subprocess.run([base]).returncode
+    return [w for bit, w in enumerate(WIDTHS) if code & (1 << bit)], compile
+
+failed = False
+with tempfile.TemporaryDirectory() as dir:
+    kernel = os.path.join(dir, "kernel.ll")
+    with open(kernel, "w") as f:
+        f.write(build())
+    for i, flags in enumerate([""] + configs):
+        wrong, compile = test(dir, "split%d" % i, flags)
+        print("%-48s %8.3fs  %s" %
+              (flags or "(none)", compile,
+               "wrong i" + ", i".join(map(str, wrong)) if wrong else "ok"))
+        if wrong and not flags:
+            sys.exit("the unobfuscated kernel is wrong")
+        failed |= bool(wrong)
+sys.exit(1 if failed else 0)